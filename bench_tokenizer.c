@@ -0,0 +1,767 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "tokenizer.h"
+
+// Throughput benchmark for training, encoding and decoding on deterministic
+// synthetic corpora. Every (corpus, size) case runs in a forked child so that
+// its peak RSS is its own, and results are written as JSON for comparing
+// releases.
+
+#define BENCH_SCHEMA_VERSION 1
+#define SMALL_INPUT_MAX (64 * 1024) // inputs up to this size also get latency percentiles
+#define MAX_SAMPLES 100000
+
+typedef enum
+{
+    CORPUS_ENGLISH,
+    CORPUS_CODE,
+    CORPUS_CJK,
+    CORPUS_EMOJI,
+    NUM_CORPUS_KINDS
+} CorpusKind;
+
+static const char *corpus_names[NUM_CORPUS_KINDS] = {"english", "code", "cjk", "emoji"};
+
+typedef struct
+{
+    bool kinds[NUM_CORPUS_KINDS];
+    size_t min_size;
+    size_t max_size;
+    int size_step; // each size is this many times the previous one
+    int vocab_size;
+    int repeat;    // samples per operation for large inputs
+    int samples;   // samples per operation for small inputs
+    int threads;   // training threads
+    uint64_t seed;
+    const char *json_path;
+} BenchOptions;
+
+typedef struct
+{
+    int samples;
+    double p50; // seconds
+    double p99;
+    double mb_per_s;     // at the median
+    double tokens_per_s; // at the median
+} OperationResult;
+
+// Plain data, so a child can send it through a pipe
+typedef struct
+{
+    int kind;
+    size_t size;
+    int tokens;
+    int vocab_size; // reached by training; below the target on tiny corpora
+    bool roundtrip;
+    OperationResult train;
+    OperationResult encode;
+    OperationResult decode;
+    long peak_rss_kb;
+    bool ok;
+} CaseResult;
+
+typedef struct
+{
+    char *bytes;
+    size_t size;
+    size_t capacity;
+    uint64_t state;
+} Corpus;
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// splitmix64: tiny, fast and identical on every platform
+static uint64_t next_random(Corpus *corpus)
+{
+    uint64_t z = (corpus->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static int random_below(Corpus *corpus, int bound)
+{
+    return (int)(next_random(corpus) % (uint64_t)bound);
+}
+
+static void append_bytes(Corpus *corpus, const char *bytes, size_t length)
+{
+    if (corpus->size + length > corpus->capacity)
+    {
+        size_t capacity = corpus->capacity ? corpus->capacity : 4096;
+        while (capacity < corpus->size + length)
+        {
+            capacity *= 2;
+        }
+        char *grown = (char *)realloc(corpus->bytes, capacity + 1);
+        if (grown == NULL)
+        {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        corpus->bytes = grown;
+        corpus->capacity = capacity;
+    }
+    memcpy(corpus->bytes + corpus->size, bytes, length);
+    corpus->size += length;
+}
+
+static void append_string(Corpus *corpus, const char *text)
+{
+    append_bytes(corpus, text, strlen(text));
+}
+
+static void append_code_point(Corpus *corpus, uint32_t cp)
+{
+    char bytes[4];
+    size_t length;
+    if (cp < 0x80)
+    {
+        bytes[0] = (char)cp;
+        length = 1;
+    }
+    else if (cp < 0x800)
+    {
+        bytes[0] = (char)(0xC0 | (cp >> 6));
+        bytes[1] = (char)(0x80 | (cp & 0x3F));
+        length = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        bytes[0] = (char)(0xE0 | (cp >> 12));
+        bytes[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        bytes[2] = (char)(0x80 | (cp & 0x3F));
+        length = 3;
+    }
+    else
+    {
+        bytes[0] = (char)(0xF0 | (cp >> 18));
+        bytes[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        bytes[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        bytes[3] = (char)(0x80 | (cp & 0x3F));
+        length = 4;
+    }
+    append_bytes(corpus, bytes, length);
+}
+
+static const char *english_words[] = {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on", "not",
+    "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they", "you", "were", "their",
+    "one", "all", "we", "can", "her", "has", "there", "been", "if", "more", "when", "will", "would", "who", "so", "no",
+    "time", "people", "water", "history", "government", "language", "system", "between", "development", "important",
+    "information", "different", "because", "through", "however", "university", "understanding", "particularly",
+    "don't", "it's", "we're", "they've", "I'll", "she'd"};
+
+static void append_english(Corpus *corpus)
+{
+    int num_words = sizeof(english_words) / sizeof(english_words[0]);
+    int sentence_length = 5 + random_below(corpus, 16);
+    for (int i = 0; i < sentence_length; ++i)
+    {
+        const char *word = english_words[random_below(corpus, num_words)];
+        if (i > 0)
+        {
+            append_string(corpus, " ");
+        }
+        if (random_below(corpus, 40) == 0)
+        {
+            char number[16];
+            snprintf(number, sizeof(number), "%d", random_below(corpus, 100000));
+            append_string(corpus, number);
+        }
+        else if (i == 0)
+        {
+            char capital = (char)(word[0] >= 'a' && word[0] <= 'z' ? word[0] - 'a' + 'A' : word[0]);
+            append_bytes(corpus, &capital, 1);
+            append_string(corpus, word + 1);
+        }
+        else
+        {
+            append_string(corpus, word);
+        }
+        if (i + 1 < sentence_length && random_below(corpus, 12) == 0)
+        {
+            append_string(corpus, ",");
+        }
+    }
+    static const char *endings[] = {". ", ". ", ". ", "? ", "! ", ".\n\n"};
+    append_string(corpus, endings[random_below(corpus, 6)]);
+}
+
+static const char *code_keywords[] = {"int", "return", "if", "else", "for", "while", "static", "const", "char", "void", "size_t", "struct"};
+static const char *code_parts[] = {"buffer", "count", "index", "node", "table", "value", "length", "result", "next", "state", "token", "offset"};
+
+static void append_identifier(Corpus *corpus)
+{
+    int num_parts = sizeof(code_parts) / sizeof(code_parts[0]);
+    append_string(corpus, code_parts[random_below(corpus, num_parts)]);
+    if (random_below(corpus, 2))
+    {
+        append_string(corpus, "_");
+        append_string(corpus, code_parts[random_below(corpus, num_parts)]);
+    }
+}
+
+static void append_code(Corpus *corpus)
+{
+    int num_keywords = sizeof(code_keywords) / sizeof(code_keywords[0]);
+    int indent = random_below(corpus, 4);
+    for (int i = 0; i < indent; ++i)
+    {
+        append_string(corpus, "    ");
+    }
+    char number[16];
+    switch (random_below(corpus, 6))
+    {
+    case 0:
+        append_string(corpus, code_keywords[random_below(corpus, num_keywords)]);
+        append_string(corpus, " ");
+        append_identifier(corpus);
+        append_string(corpus, " = ");
+        snprintf(number, sizeof(number), "%d", random_below(corpus, 4096));
+        append_string(corpus, number);
+        append_string(corpus, ";\n");
+        break;
+    case 1:
+        append_string(corpus, "if (");
+        append_identifier(corpus);
+        append_string(corpus, random_below(corpus, 2) ? " < " : " != ");
+        append_identifier(corpus);
+        append_string(corpus, ")\n");
+        break;
+    case 2:
+        append_string(corpus, "{\n");
+        break;
+    case 3:
+        append_string(corpus, "}\n\n");
+        break;
+    case 4:
+        append_identifier(corpus);
+        append_string(corpus, "(&");
+        append_identifier(corpus);
+        append_string(corpus, ", \"");
+        append_identifier(corpus);
+        append_string(corpus, "\\n\");\n");
+        break;
+    default:
+        append_string(corpus, "// ");
+        append_english(corpus);
+        append_string(corpus, "\n");
+        break;
+    }
+}
+
+static void append_cjk(Corpus *corpus)
+{
+    int sentence_length = 8 + random_below(corpus, 30);
+    for (int i = 0; i < sentence_length; ++i)
+    {
+        int choice = random_below(corpus, 20);
+        if (choice < 14)
+        {
+            // Mostly the first few thousand ideographs, so pairs repeat
+            append_code_point(corpus, 0x4E00 + (random_below(corpus, 4) ? random_below(corpus, 2500) : random_below(corpus, 20900)));
+        }
+        else if (choice < 18)
+        {
+            append_code_point(corpus, 0x3041 + random_below(corpus, 86)); // hiragana
+        }
+        else if (choice < 19)
+        {
+            append_code_point(corpus, 0xAC00 + random_below(corpus, 11172)); // hangul
+        }
+        else
+        {
+            append_code_point(corpus, 0xFF10 + random_below(corpus, 10)); // fullwidth digits
+        }
+    }
+    static const uint32_t endings[] = {0x3002, 0xFF0C, 0xFF01, '\n'};
+    append_code_point(corpus, endings[random_below(corpus, 4)]);
+}
+
+static void append_emoji(Corpus *corpus)
+{
+    int num_words = sizeof(english_words) / sizeof(english_words[0]);
+    int length = 3 + random_below(corpus, 10);
+    for (int i = 0; i < length; ++i)
+    {
+        int choice = random_below(corpus, 10);
+        if (choice < 4)
+        {
+            append_string(corpus, english_words[random_below(corpus, num_words)]);
+        }
+        else if (choice < 7)
+        {
+            append_code_point(corpus, 0x1F600 + random_below(corpus, 80));
+        }
+        else if (choice < 8)
+        {
+            // Skin tone modifier
+            append_code_point(corpus, 0x1F44B + random_below(corpus, 5));
+            append_code_point(corpus, 0x1F3FB + random_below(corpus, 5));
+        }
+        else if (choice < 9)
+        {
+            // Family: ZWJ sequence
+            append_code_point(corpus, 0x1F468);
+            append_code_point(corpus, 0x200D);
+            append_code_point(corpus, 0x1F469);
+            append_code_point(corpus, 0x200D);
+            append_code_point(corpus, 0x1F467);
+        }
+        else
+        {
+            // Flag: regional indicator pair
+            append_code_point(corpus, 0x1F1E6 + random_below(corpus, 26));
+            append_code_point(corpus, 0x1F1E6 + random_below(corpus, 26));
+        }
+        append_string(corpus, random_below(corpus, 8) ? " " : "\n");
+    }
+}
+
+// Deterministic for a given kind, size and seed. The text is exactly size
+// bytes of valid UTF-8, padded with newlines where a character would not fit.
+static char *generate_corpus(CorpusKind kind, size_t size, uint64_t seed)
+{
+    Corpus corpus = {NULL, 0, 0, seed * NUM_CORPUS_KINDS + kind};
+    while (corpus.size < size)
+    {
+        switch (kind)
+        {
+        case CORPUS_ENGLISH:
+            append_english(&corpus);
+            break;
+        case CORPUS_CODE:
+            append_code(&corpus);
+            break;
+        case CORPUS_CJK:
+            append_cjk(&corpus);
+            break;
+        default:
+            append_emoji(&corpus);
+            break;
+        }
+    }
+    size_t end = size;
+    while (end > 0 && end < corpus.size && ((unsigned char)corpus.bytes[end] & 0xC0) == 0x80)
+    {
+        end--;
+    }
+    memset(corpus.bytes + end, '\n', size - end);
+    corpus.bytes[size] = '\0';
+    return corpus.bytes;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, int count, double fraction)
+{
+    int rank = (int)ceil(fraction * count);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void summarize(double *seconds, int count, size_t bytes, int tokens, OperationResult *result)
+{
+    qsort(seconds, count, sizeof(double), compare_doubles);
+    result->samples = count;
+    result->p50 = percentile(seconds, count, 0.50);
+    result->p99 = percentile(seconds, count, 0.99);
+    double median = result->p50 > 0 ? result->p50 : 1e-9;
+    result->mb_per_s = bytes / median / 1e6;
+    result->tokens_per_s = tokens / median;
+}
+
+static void run_case(const BenchOptions *options, CorpusKind kind, size_t size, CaseResult *result)
+{
+    char *text = generate_corpus(kind, size, options->seed);
+    int count = size <= SMALL_INPUT_MAX ? options->samples : options->repeat;
+    double *seconds = (double *)malloc(count * sizeof(double));
+    char *decoded = (char *)malloc(size + 1);
+    if (seconds == NULL || decoded == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    RegexTokenizer tokenizer;
+    init_regex_tokenizer(&tokenizer, GPT2_SPLIT_PATTERN);
+    TrainOptions train_options;
+    init_train_options(&train_options);
+    train_options.num_threads = options->threads;
+    int saved_stderr = -1;
+    for (int i = 0; i < count; ++i)
+    {
+        double start = now_seconds();
+        train_regex_tokenizer_with_options(&tokenizer, text, options->vocab_size, &train_options);
+        seconds[i] = now_seconds() - start;
+        if (i == 0 && count > 1)
+        {
+            // Small corpora run out of pairs; keep the warning from the first sample only
+            fflush(stderr);
+            saved_stderr = dup(STDERR_FILENO);
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0)
+            {
+                dup2(null_fd, STDERR_FILENO);
+                close(null_fd);
+            }
+        }
+    }
+    if (saved_stderr >= 0)
+    {
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+    }
+    summarize(seconds, count, size, 0, &result->train);
+    result->vocab_size = tokenizer.vocab_size;
+
+    IntArray ids;
+    for (int i = 0; i < count; ++i)
+    {
+        double start = now_seconds();
+        encode_regex_tokenizer(&tokenizer, text, &ids);
+        seconds[i] = now_seconds() - start;
+        if (i + 1 < count)
+        {
+            free_int_array(&ids);
+        }
+    }
+    result->tokens = ids.size;
+    summarize(seconds, count, size, ids.size, &result->encode);
+
+    for (int i = 0; i < count; ++i)
+    {
+        double start = now_seconds();
+        decode_regex_tokenizer(&tokenizer, &ids, decoded, (int)size + 1);
+        seconds[i] = now_seconds() - start;
+    }
+    summarize(seconds, count, size, ids.size, &result->decode);
+    result->roundtrip = memcmp(decoded, text, size) == 0;
+
+    free_int_array(&ids);
+    free_regex_tokenizer(&tokenizer);
+    free(decoded);
+    free(seconds);
+    free(text);
+}
+
+// Runs the case in a child and collects its result and peak RSS
+static void run_case_isolated(const BenchOptions *options, CorpusKind kind, size_t size, CaseResult *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->kind = kind;
+    result->size = size;
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        return;
+    }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        run_case(options, kind, size, result);
+        result->ok = true;
+        ssize_t written = write(fds[1], result, sizeof(*result));
+        _exit(written == (ssize_t)sizeof(*result) ? 0 : 1);
+    }
+    close(fds[1]);
+    size_t received = 0;
+    while (received < sizeof(*result))
+    {
+        ssize_t n = read(fds[0], (char *)result + received, sizeof(*result) - received);
+        if (n <= 0)
+        {
+            break;
+        }
+        received += n;
+    }
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || received != sizeof(*result))
+    {
+        fprintf(stderr, "Benchmark case %s/%zu failed\n", corpus_names[kind], size);
+        result->ok = false;
+        return;
+    }
+    result->peak_rss_kb = usage.ru_maxrss; // kilobytes on Linux
+}
+
+static void write_operation_json(FILE *f, const char *name, const OperationResult *op, bool tokens, bool latency)
+{
+    fprintf(f, "\"%s\": {\"samples\": %d, \"median_seconds\": %.9f, \"mb_per_s\": %.3f", name, op->samples, op->p50, op->mb_per_s);
+    if (tokens)
+    {
+        fprintf(f, ", \"tokens_per_s\": %.1f", op->tokens_per_s);
+    }
+    if (latency)
+    {
+        fprintf(f, ", \"p50_us\": %.3f, \"p99_us\": %.3f", op->p50 * 1e6, op->p99 * 1e6);
+    }
+    fprintf(f, "}");
+}
+
+static bool write_json(const BenchOptions *options, const CaseResult *results, int num_results)
+{
+    FILE *f = strcmp(options->json_path, "-") == 0 ? stdout : fopen(options->json_path, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s for writing\n", options->json_path);
+        return false;
+    }
+    fprintf(f, "{\n  \"schema\": %d,\n  \"seed\": %llu,\n  \"vocab_size\": %d,\n  \"train_threads\": %d,\n", BENCH_SCHEMA_VERSION,
+            (unsigned long long)options->seed, options->vocab_size, options->threads);
+    fprintf(f, "  \"small_input_max\": %d,\n  \"results\": [\n", SMALL_INPUT_MAX);
+    for (int i = 0; i < num_results; ++i)
+    {
+        const CaseResult *r = &results[i];
+        bool latency = r->size <= SMALL_INPUT_MAX;
+        fprintf(f, "    {\"corpus\": \"%s\", \"bytes\": %zu, \"ok\": %s", corpus_names[r->kind], r->size, r->ok ? "true" : "false");
+        if (r->ok)
+        {
+            fprintf(f, ", \"tokens\": %d, \"vocab_size\": %d, \"roundtrip\": %s, \"peak_rss_kb\": %ld,\n     ", r->tokens, r->vocab_size,
+                    r->roundtrip ? "true" : "false", r->peak_rss_kb);
+            write_operation_json(f, "train", &r->train, false, latency);
+            fprintf(f, ",\n     ");
+            write_operation_json(f, "encode", &r->encode, true, latency);
+            fprintf(f, ",\n     ");
+            write_operation_json(f, "decode", &r->decode, true, latency);
+        }
+        fprintf(f, "}%s\n", i + 1 < num_results ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    bool ok = !ferror(f);
+    if (f != stdout)
+    {
+        ok = fclose(f) == 0 && ok;
+    }
+    return ok;
+}
+
+static void print_result(const CaseResult *r)
+{
+    if (!r->ok)
+    {
+        printf("%-8s %10zu  FAILED\n", corpus_names[r->kind], r->size);
+        return;
+    }
+    printf("%-8s %10zu  train %9.2f MB/s  encode %9.2f MB/s %12.0f tok/s  decode %9.2f MB/s  rss %8ld KB%s\n", corpus_names[r->kind],
+           r->size, r->train.mb_per_s, r->encode.mb_per_s, r->encode.tokens_per_s, r->decode.mb_per_s, r->peak_rss_kb,
+           r->roundtrip ? "" : "  ROUNDTRIP MISMATCH");
+    if (r->size <= SMALL_INPUT_MAX)
+    {
+        printf("%-8s %10s  p50/p99 us: train %.1f/%.1f  encode %.1f/%.1f  decode %.1f/%.1f\n", "", "", r->train.p50 * 1e6, r->train.p99 * 1e6,
+               r->encode.p50 * 1e6, r->encode.p99 * 1e6, r->decode.p50 * 1e6, r->decode.p99 * 1e6);
+    }
+    fflush(stdout);
+}
+
+// Accepts a plain byte count or one with a K, M or G suffix
+static bool parse_size(const char *arg, size_t *size)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    switch (*end)
+    {
+    case 'K':
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        value <<= 20;
+        end++;
+        break;
+    case 'G':
+    case 'g':
+        value <<= 30;
+        end++;
+        break;
+    }
+    if (end == arg || *end != '\0' || value == 0 || value >= (1ULL << 31))
+    {
+        return false;
+    }
+    *size = (size_t)value;
+    return true;
+}
+
+static bool parse_kinds(const char *arg, bool *kinds)
+{
+    memset(kinds, 0, NUM_CORPUS_KINDS * sizeof(bool));
+    const char *p = arg;
+    while (*p)
+    {
+        size_t length = strcspn(p, ",");
+        int kind = 0;
+        while (kind < NUM_CORPUS_KINDS && (strlen(corpus_names[kind]) != length || strncmp(p, corpus_names[kind], length) != 0))
+        {
+            kind++;
+        }
+        if (kind == NUM_CORPUS_KINDS)
+        {
+            return false;
+        }
+        kinds[kind] = true;
+        p += length + (p[length] == ',');
+    }
+    return true;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --corpus LIST    comma-separated kinds out of english,code,cjk,emoji (default all)\n"
+            "  --min-size N     smallest corpus, bytes with optional K/M/G suffix (default 1K)\n"
+            "  --max-size N     largest corpus (default 1G)\n"
+            "  --step N         size multiplier between cases (default 32)\n"
+            "  --vocab N        vocab size to train (default 1024)\n"
+            "  --repeat N       samples per operation above 64K (default 3)\n"
+            "  --samples N      samples per operation up to 64K (default 200)\n"
+            "  --threads N      training threads (default 1)\n"
+            "  --seed N         corpus seed (default 1)\n"
+            "  --json PATH      write results as JSON, - for stdout\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    for (int kind = 0; kind < NUM_CORPUS_KINDS; ++kind)
+    {
+        options.kinds[kind] = true;
+    }
+    options.min_size = 1 << 10;
+    options.max_size = 1 << 30;
+    options.size_step = 32;
+    options.vocab_size = 1024;
+    options.repeat = 3;
+    options.samples = 200;
+    options.threads = 1;
+    options.seed = 1;
+    options.json_path = NULL;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = value != NULL;
+        if (ok && strcmp(arg, "--corpus") == 0)
+        {
+            ok = parse_kinds(value, options.kinds);
+        }
+        else if (ok && strcmp(arg, "--min-size") == 0)
+        {
+            ok = parse_size(value, &options.min_size);
+        }
+        else if (ok && strcmp(arg, "--max-size") == 0)
+        {
+            ok = parse_size(value, &options.max_size);
+        }
+        else if (ok && strcmp(arg, "--step") == 0)
+        {
+            ok = (options.size_step = atoi(value)) > 1;
+        }
+        else if (ok && strcmp(arg, "--vocab") == 0)
+        {
+            ok = (options.vocab_size = atoi(value)) >= 256;
+        }
+        else if (ok && strcmp(arg, "--repeat") == 0)
+        {
+            ok = (options.repeat = atoi(value)) > 0 && options.repeat <= MAX_SAMPLES;
+        }
+        else if (ok && strcmp(arg, "--samples") == 0)
+        {
+            ok = (options.samples = atoi(value)) > 0 && options.samples <= MAX_SAMPLES;
+        }
+        else if (ok && strcmp(arg, "--threads") == 0)
+        {
+            ok = (options.threads = atoi(value)) > 0;
+        }
+        else if (ok && strcmp(arg, "--seed") == 0)
+        {
+            options.seed = strtoull(value, NULL, 10);
+        }
+        else if (ok && strcmp(arg, "--json") == 0)
+        {
+            options.json_path = value;
+        }
+        else
+        {
+            ok = false;
+        }
+        if (!ok)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+
+    int max_results = 0;
+    for (size_t size = options.min_size; size <= options.max_size; size *= options.size_step)
+    {
+        max_results += NUM_CORPUS_KINDS;
+    }
+    CaseResult *results = (CaseResult *)calloc(max_results > 0 ? max_results : 1, sizeof(CaseResult));
+    if (results == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    int num_results = 0;
+    bool all_ok = true;
+    for (size_t size = options.min_size; size <= options.max_size; size *= options.size_step)
+    {
+        for (int kind = 0; kind < NUM_CORPUS_KINDS; ++kind)
+        {
+            if (!options.kinds[kind])
+            {
+                continue;
+            }
+            CaseResult *result = &results[num_results++];
+            run_case_isolated(&options, (CorpusKind)kind, size, result);
+            print_result(result);
+            all_ok = all_ok && result->ok && result->roundtrip;
+        }
+    }
+
+    if (options.json_path && !write_json(&options, results, num_results))
+    {
+        all_ok = false;
+    }
+    free(results);
+    return all_ok ? 0 : 1;
+}
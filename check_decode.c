@@ -0,0 +1,215 @@
+// Checks the streaming decoder against decode_regex_tokenizer: random id
+// sequences, some of them the encoding of valid text, are fed one id at a time
+// and in random batches. The concatenated output must equal the whole
+// decode, with each ill-formed sequence replaced by U+FFFD as Python's
+// errors="replace" does, and every piece handed to the callback must be
+// complete UTF-8 on its own.
+//
+// Usage: ./check_decode [random sequences]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tokenizer.h"
+
+typedef struct
+{
+    char *text;
+    size_t size;
+    size_t capacity;
+    long long broken_pieces;
+} Collected;
+
+// Byte ranges of each well-formed sequence after its lead byte, per the
+// Unicode Standard, table 3-7
+typedef struct
+{
+    unsigned char lead_low, lead_high;
+    int length;
+    unsigned char low[3], high[3];
+} Utf8Form;
+
+static const Utf8Form utf8_forms[] = {
+    {0x00, 0x7F, 1, {0}, {0}},
+    {0xC2, 0xDF, 2, {0x80}, {0xBF}},
+    {0xE0, 0xE0, 3, {0xA0, 0x80}, {0xBF, 0xBF}},
+    {0xE1, 0xEC, 3, {0x80, 0x80}, {0xBF, 0xBF}},
+    {0xED, 0xED, 3, {0x80, 0x80}, {0x9F, 0xBF}},
+    {0xEE, 0xEF, 3, {0x80, 0x80}, {0xBF, 0xBF}},
+    {0xF0, 0xF0, 4, {0x90, 0x80, 0x80}, {0xBF, 0xBF, 0xBF}},
+    {0xF1, 0xF3, 4, {0x80, 0x80, 0x80}, {0xBF, 0xBF, 0xBF}},
+    {0xF4, 0xF4, 4, {0x80, 0x80, 0x80}, {0x8F, 0xBF, 0xBF}},
+};
+
+// Bytes of the well-formed sequence at bytes, or minus the length of its
+// maximal ill-formed subpart, which is replaced by one U+FFFD
+static int utf8_sequence(const unsigned char *bytes, size_t length)
+{
+    for (size_t f = 0; f < sizeof(utf8_forms) / sizeof(utf8_forms[0]); ++f)
+    {
+        const Utf8Form *form = &utf8_forms[f];
+        if (bytes[0] < form->lead_low || bytes[0] > form->lead_high)
+        {
+            continue;
+        }
+        int n = 1;
+        while (n < form->length && (size_t)n < length && bytes[n] >= form->low[n - 1] && bytes[n] <= form->high[n - 1])
+        {
+            n++;
+        }
+        return n == form->length ? n : -n;
+    }
+    return -1;
+}
+
+static void append_text(Collected *collected, const char *text, size_t length)
+{
+    if (collected->size + length > collected->capacity)
+    {
+        collected->capacity = 2 * (collected->size + length);
+        collected->text = (char *)realloc(collected->text, collected->capacity);
+        if (collected->text == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    memcpy(collected->text + collected->size, text, length);
+    collected->size += length;
+}
+
+static void collect_text(void *user_data, const char *text, size_t length)
+{
+    Collected *collected = (Collected *)user_data;
+    for (size_t i = 0; i < length;)
+    {
+        int n = utf8_sequence((const unsigned char *)text + i, length - i);
+        if (n < 0)
+        {
+            collected->broken_pieces++;
+            break;
+        }
+        i += n;
+    }
+    append_text(collected, text, length);
+}
+
+// What the stream should produce: the whole decode with ill-formed parts replaced
+static void expected_text(const RegexTokenizer *tokenizer, const IntArray *ids, Collected *expected)
+{
+    size_t size = decoded_size_regex_tokenizer(tokenizer, ids);
+    char *raw = (char *)malloc(size + 1);
+    if (raw == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    decode_regex_tokenizer(tokenizer, ids, raw, (int)size + 1);
+    expected->size = 0;
+    for (size_t i = 0; i < size;)
+    {
+        int n = utf8_sequence((const unsigned char *)raw + i, size - i);
+        if (n > 0)
+        {
+            append_text(expected, raw + i, n);
+            i += n;
+        }
+        else
+        {
+            append_text(expected, "\xEF\xBF\xBD", 3);
+            i += -n;
+        }
+    }
+    free(raw);
+}
+
+// Text in several scripts, with characters of 1 to 4 bytes
+static void random_text(char *text, int chars)
+{
+    static const char *const samples[] = {"a", "b", "e ", "th", " ", "1", "é", "ß", "ж", "λ", "ا", "中", "文", "한", "ー", "€", "😀", "🎉", "𝄞"};
+    text[0] = '\0';
+    for (int i = 0; i < chars; ++i)
+    {
+        strcat(text, samples[rand() % (sizeof(samples) / sizeof(samples[0]))]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long long sequences = argc > 1 ? atoll(argv[1]) : 30000;
+    srand(12345);
+    char *corpus = (char *)malloc(4 * 20000 + 1);
+    if (corpus == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    random_text(corpus, 20000);
+    RegexTokenizer tokenizer;
+    init_regex_tokenizer(&tokenizer, GPT2_SPLIT_PATTERN);
+    train_regex_tokenizer(&tokenizer, corpus, 600);
+
+    Collected expected = {NULL, 0, 0, 0};
+    Collected actual = {NULL, 0, 0, 0};
+    IntArray ids;
+    init_int_array(&ids, 256);
+    long long mismatches = 0;
+    long long broken_pieces = 0;
+    char text[4 * 64 + 1];
+    for (long long n = 0; n < sequences; ++n)
+    {
+        // Odd sequences encode valid text, even ones pick ids at random
+        bool from_text = n % 2 == 1;
+        if (from_text)
+        {
+            random_text(text, rand() % 64);
+            free_int_array(&ids);
+            encode_regex_tokenizer(&tokenizer, text, &ids);
+        }
+        else
+        {
+            ids.size = 0;
+            for (int length = rand() % 64; ids.size < length;)
+            {
+                append_int_array(&ids, rand() % tokenizer.vocab_size);
+            }
+        }
+        expected_text(&tokenizer, &ids, &expected);
+        if (from_text && (expected.size != strlen(text) || memcmp(expected.text, text, expected.size) != 0))
+        {
+            fprintf(stderr, "Sequence %lld does not decode back to its text\n", n);
+            mismatches++;
+        }
+
+        for (int batched = 0; batched < 2; ++batched)
+        {
+            DecodeStream stream;
+            actual.size = 0;
+            actual.broken_pieces = 0;
+            init_decode_stream(&stream, &tokenizer, collect_text, &actual);
+            for (int i = 0; i < ids.size;)
+            {
+                int count = batched ? 1 + rand() % 8 : 1;
+                count = count < ids.size - i ? count : ids.size - i;
+                decode_stream_write(&stream, ids.ids + i, count);
+                i += count;
+            }
+            decode_stream_finish(&stream);
+            broken_pieces += actual.broken_pieces;
+            if (actual.size != expected.size || memcmp(actual.text, expected.text, actual.size) != 0)
+            {
+                if (mismatches < 20)
+                {
+                    fprintf(stderr, "Sequence %lld decodes differently %s\n", n, batched ? "in batches" : "one id at a time");
+                }
+                mismatches++;
+            }
+        }
+    }
+    printf("Decode stream vs decode: %lld sequences, %lld mismatches, %lld incomplete pieces\n", sequences, mismatches, broken_pieces);
+    free(expected.text);
+    free(actual.text);
+    free(corpus);
+    free_int_array(&ids);
+    free_regex_tokenizer(&tokenizer);
+    return mismatches == 0 && broken_pieces == 0 ? 0 : 1;
+}
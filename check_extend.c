@@ -0,0 +1,103 @@
+// Checks continued training: learning N merges and then extending to M must
+// give the same merges, vocab and encodings as learning M merges at once on
+// the same corpus, serially and with several threads, in one step or two.
+//
+// Usage: ./check_extend
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tokenizer.h"
+
+// Words built from a few syllables, so many pairs tie on count
+static char *random_corpus(int words)
+{
+    static const char *const syllables[] = {"ka", "to", "ri", "an", "en", "ß", "中", "é", " ", "1", "!", "😀"};
+    char *text = (char *)malloc((size_t)words * 5 * 4 + 1);
+    if (text == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    text[0] = '\0';
+    for (int i = 0; i < words; ++i)
+    {
+        for (int length = 1 + rand() % 4; length > 0; --length)
+        {
+            strcat(text, syllables[rand() % (sizeof(syllables) / sizeof(syllables[0]))]);
+        }
+        strcat(text, " ");
+    }
+    return text;
+}
+
+static bool same_tokenizers(const RegexTokenizer *a, const RegexTokenizer *b, const char *text)
+{
+    if (a->merge_size != b->merge_size || memcmp(a->merges, b->merges, a->merge_size * sizeof(Pair)) != 0)
+    {
+        return false;
+    }
+    if (a->vocab_size != b->vocab_size || a->vocab_offsets[a->vocab_size] != b->vocab_offsets[b->vocab_size] ||
+        memcmp(a->vocab_offsets, b->vocab_offsets, (a->vocab_size + 1) * sizeof(size_t)) != 0 ||
+        memcmp(a->vocab_bytes, b->vocab_bytes, a->vocab_offsets[a->vocab_size]) != 0)
+    {
+        return false;
+    }
+    IntArray ids_a;
+    IntArray ids_b;
+    encode_regex_tokenizer(a, text, &ids_a);
+    encode_regex_tokenizer(b, text, &ids_b);
+    bool same = ids_a.size == ids_b.size && memcmp(ids_a.ids, ids_b.ids, ids_a.size * sizeof(int)) == 0;
+    free_int_array(&ids_a);
+    free_int_array(&ids_b);
+    return same;
+}
+
+int main(void)
+{
+    // Merges learned first, then in the middle step, then in all
+    static const int steps[][3] = {{0, 20, 44}, {10, 100, 144}, {200, 201, 244}, {50, 150, 444}};
+    srand(12345);
+    char *corpus = random_corpus(30000);
+    int runs = 0;
+    int mismatches = 0;
+    for (int threads = 1; threads <= 4; threads += 3)
+    {
+        TrainOptions options;
+        init_train_options(&options);
+        options.num_threads = threads;
+        for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); ++s)
+        {
+            const int *merges = steps[s];
+            RegexTokenizer fresh;
+            init_regex_tokenizer(&fresh, GPT2_SPLIT_PATTERN);
+            train_regex_tokenizer_with_options(&fresh, corpus, 256 + merges[2], &options);
+
+            // Straight from the first step to the last, and through the middle one
+            for (int via_middle = 0; via_middle < 2; ++via_middle)
+            {
+                RegexTokenizer extended;
+                init_regex_tokenizer(&extended, GPT2_SPLIT_PATTERN);
+                train_regex_tokenizer_with_options(&extended, corpus, 256 + merges[0], &options);
+                TrainOptions extend = options;
+                extend.extend_merges = true;
+                if (via_middle)
+                {
+                    train_regex_tokenizer_with_options(&extended, corpus, 256 + merges[1], &extend);
+                }
+                train_regex_tokenizer_with_options(&extended, corpus, 256 + merges[2], &extend);
+                runs++;
+                if (!same_tokenizers(&fresh, &extended, corpus))
+                {
+                    fprintf(stderr, "%d threads: %d merges extended to %d%s differ from a fresh run\n", threads, merges[0], merges[2],
+                            via_middle ? " in two steps" : "");
+                    mismatches++;
+                }
+                free_regex_tokenizer(&extended);
+            }
+            free_regex_tokenizer(&fresh);
+        }
+    }
+    printf("Extended vs fresh training: %d runs, %d mismatches\n", runs, mismatches);
+    free(corpus);
+    return mismatches == 0 ? 0 : 1;
+}
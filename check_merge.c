@@ -0,0 +1,154 @@
+// Checks every merge kernel this CPU can run against merge_kernel_scalar:
+// runs of a self pair (a, a), a single match at every position so that some
+// straddle the 4, 8 and 16 lane blocks, and random arrays over a small
+// alphabet, from empty up to several vectors long. The kernels are static, so
+// tokenizer.c is built into this program.
+//
+// Usage: ./check_merge [random arrays]
+#include "tokenizer.c"
+
+#define CHECK_MERGE_MAX_LENGTH 200
+
+typedef struct
+{
+    const char *name;
+    MergeKernel kernel;
+    long long arrays;
+    long long mismatches;
+} KernelCheck;
+
+static void print_ids(const int *ids, int length)
+{
+    for (int i = 0; i < length; ++i)
+    {
+        fprintf(stderr, "%d%s", ids[i], i + 1 < length ? " " : "");
+    }
+}
+
+static void check_array(KernelCheck *check, const int *ids, int length, Pair pair, int idx)
+{
+    int expected[CHECK_MERGE_MAX_LENGTH];
+    int actual[CHECK_MERGE_MAX_LENGTH];
+    memcpy(expected, ids, length * sizeof(int));
+    memcpy(actual, ids, length * sizeof(int));
+    int expected_length = merge_kernel_scalar(expected, length, pair, idx);
+    int actual_length = check->kernel(actual, length, pair, idx);
+    check->arrays++;
+    if (actual_length == expected_length && memcmp(actual, expected, expected_length * sizeof(int)) == 0)
+    {
+        return;
+    }
+    if (check->mismatches++ < 20)
+    {
+        fprintf(stderr, "%s mismatch merging (%d, %d) in [", check->name, pair.first, pair.second);
+        print_ids(ids, length);
+        fprintf(stderr, "]: expected [");
+        print_ids(expected, expected_length);
+        fprintf(stderr, "], got [");
+        print_ids(actual, actual_length);
+        fprintf(stderr, "]\n");
+    }
+}
+
+// Runs of a at every offset, which the kernels must merge greedily from the left
+static void check_self_pair_runs(KernelCheck *check)
+{
+    int ids[CHECK_MERGE_MAX_LENGTH];
+    for (int length = 0; length <= 40; ++length)
+    {
+        for (int start = 0; start <= length; ++start)
+        {
+            for (int run = 0; start + run <= length; ++run)
+            {
+                for (int i = 0; i < length; ++i)
+                {
+                    ids[i] = i >= start && i < start + run ? 7 : 1 + i % 5;
+                }
+                check_array(check, ids, length, (Pair){7, 7}, 300);
+            }
+        }
+    }
+}
+
+// One or two matches placed everywhere, including across block edges
+static void check_placed_matches(KernelCheck *check)
+{
+    int ids[CHECK_MERGE_MAX_LENGTH];
+    for (int length = 0; length <= 70; ++length)
+    {
+        for (int a = -1; a + 1 < length; ++a)
+        {
+            for (int b = a; b + 1 < length; ++b)
+            {
+                for (int i = 0; i < length; ++i)
+                {
+                    ids[i] = 10 + i % 3;
+                }
+                if (a >= 0)
+                {
+                    ids[a] = 1;
+                    ids[a + 1] = 2;
+                }
+                if (b > a + 1)
+                {
+                    ids[b] = 1;
+                    ids[b + 1] = 2;
+                }
+                check_array(check, ids, length, (Pair){1, 2}, 300);
+            }
+        }
+    }
+}
+
+static void check_random_arrays(KernelCheck *check, long long count)
+{
+    int ids[CHECK_MERGE_MAX_LENGTH];
+    srand(12345);
+    for (long long n = 0; n < count; ++n)
+    {
+        int length = rand() % 4 == 0 ? rand() % 20 : rand() % CHECK_MERGE_MAX_LENGTH;
+        int alphabet = 2 + rand() % 4;
+        for (int i = 0; i < length; ++i)
+        {
+            ids[i] = rand() % alphabet;
+        }
+        Pair pair = {rand() % alphabet, rand() % alphabet};
+        check_array(check, ids, length, pair, 256 + rand() % 1000);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long long random_arrays = argc > 1 ? atoll(argv[1]) : 1000000;
+    KernelCheck checks[3];
+    int num_checks = 0;
+#if defined(MERGE_KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        checks[num_checks++] = (KernelCheck){"avx2", merge_kernel_avx2, 0, 0};
+    }
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        checks[num_checks++] = (KernelCheck){"avx512", merge_kernel_avx512, 0, 0};
+    }
+#elif defined(MERGE_KERNEL_NEON)
+    checks[num_checks++] = (KernelCheck){"neon", merge_kernel_neon, 0, 0};
+#endif
+    if (num_checks == 0)
+    {
+        printf("No vector merge kernel runs on this CPU\n");
+        return 0;
+    }
+
+    long long mismatches = 0;
+    for (int i = 0; i < num_checks; ++i)
+    {
+        check_self_pair_runs(&checks[i]);
+        check_placed_matches(&checks[i]);
+        check_random_arrays(&checks[i], random_arrays);
+        printf("Merge kernel %s vs scalar: %lld arrays, %lld mismatches\n", checks[i].name, checks[i].arrays, checks[i].mismatches);
+        mismatches += checks[i].mismatches;
+    }
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+// Checks the hand-written GPT-2 scanner against pcre_exec on the same pattern:
+// every code point in several contexts, then random subjects, each with and
+// without PCRE_PARTIAL_HARD. The scanner is static, so tokenizer.c is built
+// into this program.
+//
+// Usage: ./check_split [random subjects]
+#include "tokenizer.c"
+
+typedef struct
+{
+    pcre *re;
+    pcre_extra *extra;
+    long long subjects;
+    long long mismatches;
+} SplitCheck;
+
+static bool is_utf8_error(int rc)
+{
+    return rc == PCRE_ERROR_BADUTF8 || rc == PCRE_ERROR_SHORTUTF8;
+}
+
+static void print_subject(const unsigned char *subject, int length)
+{
+    for (int i = 0; i < length; ++i)
+    {
+        fprintf(stderr, "%02X%s", subject[i], i + 1 < length ? " " : "");
+    }
+}
+
+static void check_subject(SplitCheck *check, const unsigned char *subject, int length, int options)
+{
+    int scanner_ovector[30];
+    int pcre_ovector[30];
+    int scanner_rc = gpt2_split_exec((const char *)subject, length, options, scanner_ovector);
+    int pcre_rc = pcre_exec(check->re, check->extra, (const char *)subject, length, 0, options, pcre_ovector, 30);
+    check->subjects++;
+    bool same = scanner_rc == pcre_rc || (is_utf8_error(scanner_rc) && is_utf8_error(pcre_rc));
+    if (same && (scanner_rc >= 0 || scanner_rc == PCRE_ERROR_PARTIAL))
+    {
+        same = scanner_ovector[0] == pcre_ovector[0] && scanner_ovector[1] == pcre_ovector[1];
+    }
+    if (same)
+    {
+        return;
+    }
+    if (check->mismatches++ < 20)
+    {
+        fprintf(stderr, "Mismatch on [");
+        print_subject(subject, length);
+        fprintf(stderr, "] options 0x%X: scanner %d (%d, %d), pcre %d (%d, %d)\n", options, scanner_rc, scanner_ovector[0],
+                scanner_ovector[1], pcre_rc, pcre_ovector[0], pcre_ovector[1]);
+    }
+}
+
+static void check_both_modes(SplitCheck *check, const unsigned char *subject, int length)
+{
+    check_subject(check, subject, length, 0);
+    check_subject(check, subject, length, PCRE_PARTIAL_HARD);
+}
+
+// Each code point alone and after a character of each class the scanner tells apart
+static void check_all_code_points(SplitCheck *check)
+{
+    static const char prefixes[] = {' ', 'a', '1', '!', '\t', '\''};
+    unsigned char subject[8];
+    for (uint32_t cp = 0; cp <= 0x10FFFF; ++cp)
+    {
+        if (cp >= 0xD800 && cp <= 0xDFFF)
+        {
+            continue;
+        }
+        int width = encode_utf8_char(cp, subject);
+        check_both_modes(check, subject, width);
+        for (size_t i = 0; i < sizeof(prefixes); ++i)
+        {
+            subject[0] = (unsigned char)prefixes[i];
+            width = encode_utf8_char(cp, subject + 1);
+            check_both_modes(check, subject, width + 1);
+        }
+    }
+}
+
+static uint32_t random_code_point(void)
+{
+    static const char common[] = " \t\n\r\v\f'sdmtlvre aA1!?.,-_";
+    static const uint32_t scripts[] = {0xE9, 0x3B1, 0x430, 0x5D0, 0x627, 0x660, 0x905, 0x966, 0x4E00, 0x3042, 0xAC00, 0xFF10, 0x1F600, 0x20000, 0xA0, 0x2028};
+    switch (rand() % 4)
+    {
+    case 0:
+    case 1:
+        return (unsigned char)common[rand() % (sizeof(common) - 1)];
+    case 2:
+        return scripts[rand() % (sizeof(scripts) / sizeof(scripts[0]))];
+    default:
+    {
+        uint32_t cp = (uint32_t)rand() % 0x110000;
+        return cp >= 0xD800 && cp <= 0xDFFF ? cp - 0x800 : cp;
+    }
+    }
+}
+
+// Mostly valid text, with the odd stray or truncated byte to exercise the UTF-8 check
+static void check_random_subjects(SplitCheck *check, long long count)
+{
+    unsigned char subject[256];
+    srand(12345);
+    for (long long n = 0; n < count; ++n)
+    {
+        int chars = rand() % 24;
+        int length = 0;
+        bool valid = true;
+        for (int i = 0; i < chars; ++i)
+        {
+            if (rand() % 200 == 0)
+            {
+                static const unsigned char invalid[] = {0x80, 0xBF, 0xC0, 0xC1, 0xE0, 0xED, 0xF0, 0xF5, 0xFF};
+                subject[length++] = invalid[rand() % sizeof(invalid)];
+                valid = false;
+                continue;
+            }
+            length += encode_utf8_char(random_code_point(), subject + length);
+        }
+        if (valid && length > 0 && rand() % 8 == 0)
+        {
+            length--; // Cuts the last character short if it is multibyte
+            valid = is_valid_utf8(subject, length);
+        }
+        check_both_modes(check, subject, length);
+        if (valid)
+        {
+            check_subject(check, subject, length, PCRE_NO_UTF8_CHECK);
+            check_subject(check, subject, length, PCRE_NO_UTF8_CHECK | PCRE_PARTIAL_HARD);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long long random_subjects = argc > 1 ? atoll(argv[1]) : 1000000;
+    RegexTokenizer tokenizer;
+    init_regex_tokenizer(&tokenizer, GPT2_SPLIT_PATTERN);
+    if (!gpt2_scanner_matches_pcre())
+    {
+        // The scanner would disagree wherever the Unicode versions do, so it must not be in use
+        bool fallback = tokenizer.split_scanner == SPLIT_SCANNER_PCRE;
+        printf("Unicode tables differ from the linked PCRE: GPT-2 pattern %s\n",
+               fallback ? "falls back to PCRE" : "still uses the scanner");
+        free_regex_tokenizer(&tokenizer);
+        return fallback ? 0 : 1;
+    }
+
+    SplitCheck check = {tokenizer.compiled_pattern, tokenizer.compiled_pattern_extra, 0, 0};
+    check_all_code_points(&check);
+    long long swept = check.subjects;
+    check_random_subjects(&check, random_subjects);
+    printf("Scanner vs pcre_exec: %lld code point subjects, %lld random subjects, %lld mismatches\n", swept,
+           check.subjects - swept, check.mismatches);
+    free_regex_tokenizer(&tokenizer);
+    return check.mismatches == 0 ? 0 : 1;
+}
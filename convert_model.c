@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include "tokenizer.h"
+
+// Converts a text model written by save_tokenizer into the binary format read
+// by init_regex_tokenizer_from_binary.
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <input.model> <output.bin>\n", argv[0]);
+        return 1;
+    }
+
+    // load_tokenizer replaces the pattern with the one stored in the model
+    RegexTokenizer tokenizer;
+    init_regex_tokenizer(&tokenizer, GPT2_SPLIT_PATTERN);
+    if (!load_tokenizer(&tokenizer, argv[1]) || !save_tokenizer_binary(&tokenizer, argv[2]))
+    {
+        free_regex_tokenizer(&tokenizer);
+        return 1;
+    }
+    printf("Converted %d merges and %d special tokens to %s\n", tokenizer.merge_size, tokenizer.special_size, argv[2]);
+
+    free_regex_tokenizer(&tokenizer);
+    return 0;
+}
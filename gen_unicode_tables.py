@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+"""Generates unicode_tables.c: code point ranges for \\p{L} and \\p{N}.
+
+Usage: python3 gen_unicode_tables.py > unicode_tables.c
+"""
+import sys
+import unicodedata
+
+
+def ranges(prefix):
+    out = []
+    for cp in range(0x110000):
+        if unicodedata.category(chr(cp)).startswith(prefix):
+            if out and out[-1][1] == cp - 1:
+                out[-1][1] = cp
+            else:
+                out.append([cp, cp])
+    return out
+
+
+def emit(name, rs):
+    print("const UnicodeRange %s[] = {" % name)
+    for i in range(0, len(rs), 4):
+        print("    " + " ".join("{0x%04X, 0x%04X}," % (a, b) for a, b in rs[i:i + 4]))
+    print("};")
+    print("const int %s_size = %d;" % (name, len(rs)))
+
+
+print("// Generated by gen_unicode_tables.py from Unicode %s. Do not edit." % unicodedata.unidata_version)
+print('#include "unicode_tables.h"')
+print()
+emit("unicode_letter_ranges", ranges("L"))
+print()
+emit("unicode_number_ranges", ranges("N"))
@@ -1,48 +1,397 @@
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <pcre.h>
 #include "tokenizer.h"
+#include "unicode_tables.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-void init_pair_count_table(PairCountTable *table, int initial_capacity)
+static TraceCallback trace_callback;
+static void *trace_user_data;
+
+// Installs the callback that receives trace events, or removes it when NULL.
+// Set it before other threads start using tokenizers. Returns false if this
+// build has tracing compiled out (TOKENIZER_TRACE_LEVEL 0).
+bool set_trace_callback(TraceCallback callback, void *user_data)
+{
+    if (TOKENIZER_TRACE_LEVEL == TRACE_LEVEL_NONE)
+    {
+        return false;
+    }
+    trace_callback = callback;
+    trace_user_data = user_data;
+    return true;
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Both macros are constant-false above the compiled-in level, so disabled
+// tracing costs nothing, not even the clock reads. TRACE takes the event's
+// fields as designated initializers.
+#define TRACE_ENABLED(level) (TOKENIZER_TRACE_LEVEL >= (level) && trace_callback != NULL)
+#define TRACE_CLOCK(level) (TRACE_ENABLED(level) ? monotonic_seconds() : 0.0)
+#define TRACE(level, ...)                                  \
+    do                                                     \
+    {                                                      \
+        if (TRACE_ENABLED(level))                          \
+        {                                                  \
+            TraceEvent trace_event = {__VA_ARGS__};        \
+            trace_callback(trace_user_data, &trace_event); \
+        }                                                  \
+    } while (0)
+
+// Heap allocations made by the library in this process, across all tokenizers.
+// Allocations inside libc and PCRE (getline, pcre_compile) are not seen.
+static uint64_t heap_allocations;
+
+static inline void count_heap_allocation(void)
+{
+    __atomic_fetch_add(&heap_allocations, 1, __ATOMIC_RELAXED);
+}
+
+// Every heap allocation of the library goes through these so that
+// heap_allocations sees it. Failures return NULL for the caller to report.
+static void *counted_malloc(size_t size)
+{
+    count_heap_allocation();
+    return malloc(size);
+}
+
+static void *counted_calloc(size_t count, size_t size)
+{
+    count_heap_allocation();
+    return calloc(count, size);
+}
+
+static void *counted_realloc(void *memory, size_t size)
+{
+    count_heap_allocation();
+    return realloc(memory, size);
+}
+
+static char *counted_strdup(const char *text)
+{
+    count_heap_allocation();
+    return strdup(text);
+}
+
+// Counters of one encode or decode call, kept on its stack and added to the
+// tokenizer's recorder once at the end, so each call costs a fixed handful of
+// relaxed atomic adds however many chunks it splits
+typedef struct MetricsSample
+{
+    MetricsRecorder *recorder; // NULL when metrics are off for this call
+    double start;
+    double merge_seconds;
+    uint64_t chunks;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+} MetricsSample;
+
+// Starts a sample if the tokenizer records metrics. Chunk counters come from
+// encode_piece_with_cache through scratch, which may be NULL for decoding.
+static void begin_metrics_sample(const RegexTokenizer *tokenizer, MetricsSample *sample, BpeScratch *scratch)
+{
+    MetricsRecorder *recorder = tokenizer->metrics;
+    sample->recorder = recorder && __atomic_load_n(&recorder->enabled, __ATOMIC_RELAXED) ? recorder : NULL;
+    if (sample->recorder == NULL)
+    {
+        return;
+    }
+    sample->start = monotonic_seconds();
+    sample->merge_seconds = 0.0;
+    sample->chunks = 0;
+    sample->cache_hits = 0;
+    sample->cache_misses = 0;
+    if (scratch)
+    {
+        scratch->metrics = sample;
+    }
+}
+
+static inline void add_metric(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static int latency_bucket(uint64_t nanoseconds)
+{
+    uint64_t microseconds = nanoseconds / 1000;
+    int bucket = microseconds > 0 ? 64 - __builtin_clzll(microseconds) : 0;
+    return bucket < METRICS_LATENCY_BUCKETS ? bucket : METRICS_LATENCY_BUCKETS;
+}
+
+static void end_encode_sample(MetricsSample *sample, BpeScratch *scratch, size_t bytes, size_t tokens)
+{
+    if (sample->recorder == NULL)
+    {
+        return;
+    }
+    if (scratch)
+    {
+        scratch->metrics = NULL;
+    }
+    TokenizerMetrics *counters = &sample->recorder->counters;
+    uint64_t elapsed = (uint64_t)((monotonic_seconds() - sample->start) * 1e9);
+    add_metric(&counters->encode_calls, 1);
+    add_metric(&counters->encode_bytes, bytes);
+    add_metric(&counters->encode_tokens, tokens);
+    add_metric(&counters->chunks, sample->chunks);
+    add_metric(&counters->cache_hits, sample->cache_hits);
+    add_metric(&counters->cache_misses, sample->cache_misses);
+    add_metric(&counters->encode_ns, elapsed);
+    add_metric(&counters->merge_ns, (uint64_t)(sample->merge_seconds * 1e9));
+    add_metric(&counters->encode_latency[latency_bucket(elapsed)], 1);
+}
+
+static void end_decode_sample(MetricsSample *sample, size_t tokens, size_t bytes)
+{
+    if (sample->recorder == NULL)
+    {
+        return;
+    }
+    TokenizerMetrics *counters = &sample->recorder->counters;
+    uint64_t elapsed = (uint64_t)((monotonic_seconds() - sample->start) * 1e9);
+    add_metric(&counters->decode_calls, 1);
+    add_metric(&counters->decode_tokens, tokens);
+    add_metric(&counters->decode_bytes, bytes);
+    add_metric(&counters->decode_ns, elapsed);
+    add_metric(&counters->decode_latency[latency_bucket(elapsed)], 1);
+}
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_MIN_BLOCK 4096
+
+static size_t align_arena_size(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static ArenaBlock *push_arena_block(Arena *arena, size_t size)
+{
+    ArenaBlock *block = (ArenaBlock *)counted_malloc(align_arena_size(sizeof(ArenaBlock)) + size);
+    if (block == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for arena\n");
+        exit(1);
+    }
+    block->next = arena->head;
+    block->size = size;
+    block->used = 0;
+    arena->head = block;
+    arena->total += size;
+    return block;
+}
+
+void init_arena(Arena *arena, size_t initial_size)
+{
+    arena->head = NULL;
+    arena->total = 0;
+    if (initial_size > 0)
+    {
+        push_arena_block(arena, align_arena_size(initial_size));
+    }
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = align_arena_size(size > 0 ? size : 1);
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t block_size = block ? 2 * block->size : ARENA_MIN_BLOCK;
+        push_arena_block(arena, block_size > size ? block_size : size);
+        block = arena->head;
+    }
+    void *memory = (char *)block + align_arena_size(sizeof(ArenaBlock)) + block->used;
+    block->used += size;
+    return memory;
+}
+
+void reset_arena(Arena *arena)
+{
+    if (arena->head && arena->head->next)
+    {
+        // One block as large as all of them together serves the next cycle
+        size_t total = arena->total;
+        free_arena(arena);
+        push_arena_block(arena, total);
+    }
+    else if (arena->head)
+    {
+        arena->head->used = 0;
+    }
+}
+
+void free_arena(Arena *arena)
+{
+    while (arena->head)
+    {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->total = 0;
+}
+
+// Memory of a container that may live in an arena. Arena memory is never
+// freed on its own, so growing there copies into a fresh allocation.
+static void *container_alloc(Arena *arena, size_t size)
 {
-    table->pairs = (Pair *)malloc(initial_capacity * sizeof(Pair));
-    table->counts = (int *)malloc(initial_capacity * sizeof(int));
-    if (table->pairs == NULL || table->counts == NULL)
+    if (arena)
+    {
+        return arena_alloc(arena, size);
+    }
+    void *memory = counted_malloc(size > 0 ? size : 1);
+    if (memory == NULL)
     {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
+    return memory;
+}
+
+static void *container_realloc(Arena *arena, void *memory, size_t old_size, size_t new_size)
+{
+    if (arena)
+    {
+        void *grown = arena_alloc(arena, new_size);
+        if (old_size > 0)
+        {
+            memcpy(grown, memory, old_size < new_size ? old_size : new_size);
+        }
+        return grown;
+    }
+    void *grown = counted_realloc(memory, new_size > 0 ? new_size : 1);
+    if (grown == NULL)
+    {
+        fprintf(stderr, "Memory reallocation failed\n");
+        exit(1);
+    }
+    return grown;
+}
+
+static void container_free(Arena *arena, void *memory)
+{
+    if (arena == NULL)
+    {
+        free(memory);
+    }
+}
+
+static inline uint64_t pack_pair(Pair pair)
+{
+    return ((uint64_t)(uint32_t)pair.first << 32) | (uint32_t)pair.second;
+}
+
+static inline uint32_t hash_pair(Pair pair)
+{
+    // Fibonacci hashing: the high bits of the product are well mixed
+    return (uint32_t)((pack_pair(pair) * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static void rehash_pair_slots(PairCountTable *table, int slot_capacity)
+{
+    int *slots = (int *)container_alloc(table->arena, slot_capacity * sizeof(int));
+    memset(slots, -1, slot_capacity * sizeof(int));
+    int mask = slot_capacity - 1;
+    for (int i = 0; i < table->size; ++i)
+    {
+        uint32_t slot = hash_pair(table->pairs[i]) & mask;
+        while (slots[slot] >= 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = i;
+    }
+    container_free(table->arena, table->slots);
+    table->slots = slots;
+    table->slot_mask = mask;
+}
+
+void init_pair_count_table(PairCountTable *table, int initial_capacity)
+{
+    init_pair_count_table_in_arena(table, NULL, initial_capacity);
+}
+
+void init_pair_count_table_in_arena(PairCountTable *table, Arena *arena, int initial_capacity)
+{
+    if (initial_capacity < 1)
+    {
+        initial_capacity = 1;
+    }
+    table->arena = arena;
+    table->pairs = (Pair *)container_alloc(arena, initial_capacity * sizeof(Pair));
+    table->counts = (int *)container_alloc(arena, initial_capacity * sizeof(int));
     table->size = 0;
     table->capacity = initial_capacity;
+
+    // Keep the load factor of the slot array at or below one half
+    int slot_capacity = 2;
+    while (slot_capacity < 2 * initial_capacity)
+    {
+        slot_capacity *= 2;
+    }
+    table->slots = NULL;
+    rehash_pair_slots(table, slot_capacity);
 }
 
 void free_pair_count_table(PairCountTable *table)
 {
-    if (table->pairs)
-        free(table->pairs);
-    if (table->counts)
-        free(table->counts);
+    container_free(table->arena, table->pairs);
+    container_free(table->arena, table->counts);
+    container_free(table->arena, table->slots);
+    table->pairs = NULL;
+    table->counts = NULL;
+    table->slots = NULL;
     table->size = 0;
     table->capacity = 0;
+    table->slot_mask = 0;
 }
 
-int find_pair_index(PairCountTable *table, Pair pair)
+// Returns the slot holding pair, or the empty slot where it would be inserted
+static uint32_t find_pair_slot(const PairCountTable *table, Pair pair)
 {
-    for (int i = 0; i < table->size; ++i)
+    uint32_t slot = hash_pair(pair) & table->slot_mask;
+    while (table->slots[slot] >= 0)
     {
-        if (table->pairs[i].first == pair.first && table->pairs[i].second == pair.second)
+        Pair candidate = table->pairs[table->slots[slot]];
+        if (candidate.first == pair.first && candidate.second == pair.second)
         {
-            return i;
+            break;
         }
+        slot = (slot + 1) & table->slot_mask;
     }
-    return -1;
+    return slot;
+}
+
+int find_pair_index(PairCountTable *table, Pair pair)
+{
+    return table->slots[find_pair_slot(table, pair)];
 }
 
 void add_or_update_pair_count(PairCountTable *table, Pair pair)
 {
-    int index = find_pair_index(table, pair);
+    uint32_t slot = find_pair_slot(table, pair);
+    int index = table->slots[slot];
     if (index >= 0)
     {
         table->counts[index]++;
@@ -52,16 +401,12 @@ void add_or_update_pair_count(PairCountTable *table, Pair pair)
         if (table->size == table->capacity)
         {
             table->capacity *= 2;
-            Pair *new_pairs = (Pair *)realloc(table->pairs, table->capacity * sizeof(Pair));
-            int *new_counts = (int *)realloc(table->counts, table->capacity * sizeof(int));
-            if (new_pairs == NULL || new_counts == NULL)
-            {
-                fprintf(stderr, "Memory reallocation failed\n");
-                exit(1);
-            }
-            table->pairs = new_pairs;
-            table->counts = new_counts;
+            table->pairs = (Pair *)container_realloc(table->arena, table->pairs, table->size * sizeof(Pair), table->capacity * sizeof(Pair));
+            table->counts = (int *)container_realloc(table->arena, table->counts, table->size * sizeof(int), table->capacity * sizeof(int));
+            rehash_pair_slots(table, 2 * (table->slot_mask + 1));
+            slot = find_pair_slot(table, pair);
         }
+        table->slots[slot] = table->size;
         table->pairs[table->size] = pair;
         table->counts[table->size] = 1;
         table->size++;
@@ -85,516 +430,5270 @@ void print_pair_counts(PairCountTable *table)
     }
 }
 
-void init_int_array(IntArray *array, int initial_capacity)
+static uint32_t hash_bytes(const char *bytes, int length)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void rehash_chunk_slots(ChunkCountTable *table, int slot_capacity)
+{
+    int *slots = (int *)counted_malloc(slot_capacity * sizeof(int));
+    if (slots == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(slots, -1, slot_capacity * sizeof(int));
+    int mask = slot_capacity - 1;
+    for (int i = 0; i < table->size; ++i)
+    {
+        uint32_t slot = table->chunks[i].hash & mask;
+        while (slots[slot] >= 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = i;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slot_mask = mask;
+}
+
+void init_chunk_count_table(ChunkCountTable *table, int initial_capacity)
 {
-    array->ids = (int *)malloc(initial_capacity * sizeof(int));
-    if (array->ids == NULL)
+    if (initial_capacity < 1)
+    {
+        initial_capacity = 1;
+    }
+    table->bytes_capacity = (size_t)initial_capacity * 8;
+    table->bytes = (char *)counted_malloc(table->bytes_capacity);
+    table->chunks = (Chunk *)counted_malloc(initial_capacity * sizeof(Chunk));
+    table->counts = (long long *)counted_malloc(initial_capacity * sizeof(long long));
+    if (table->bytes == NULL || table->chunks == NULL || table->counts == NULL)
     {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
+    table->bytes_size = 0;
+    table->size = 0;
+    table->capacity = initial_capacity;
+
+    int slot_capacity = 2;
+    while (slot_capacity < 2 * initial_capacity)
+    {
+        slot_capacity *= 2;
+    }
+    table->slots = NULL;
+    rehash_chunk_slots(table, slot_capacity);
+}
+
+void free_chunk_count_table(ChunkCountTable *table)
+{
+    free(table->bytes);
+    free(table->chunks);
+    free(table->counts);
+    free(table->slots);
+    table->bytes = NULL;
+    table->chunks = NULL;
+    table->counts = NULL;
+    table->slots = NULL;
+    table->bytes_size = 0;
+    table->bytes_capacity = 0;
+    table->size = 0;
+    table->capacity = 0;
+    table->slot_mask = 0;
+}
+
+void add_chunk_count(ChunkCountTable *table, const char *bytes, int length, long long count)
+{
+    uint32_t hash = hash_bytes(bytes, length);
+    uint32_t slot = hash & table->slot_mask;
+    while (table->slots[slot] >= 0)
+    {
+        Chunk *chunk = &table->chunks[table->slots[slot]];
+        if (chunk->hash == hash && chunk->length == length && memcmp(table->bytes + chunk->offset, bytes, length) == 0)
+        {
+            table->counts[table->slots[slot]] += count;
+            return;
+        }
+        slot = (slot + 1) & table->slot_mask;
+    }
+
+    if (table->size == table->capacity)
+    {
+        table->capacity *= 2;
+        Chunk *new_chunks = (Chunk *)counted_realloc(table->chunks, table->capacity * sizeof(Chunk));
+        long long *new_counts = (long long *)counted_realloc(table->counts, table->capacity * sizeof(long long));
+        if (new_chunks == NULL || new_counts == NULL)
+        {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        table->chunks = new_chunks;
+        table->counts = new_counts;
+        rehash_chunk_slots(table, 2 * (table->slot_mask + 1));
+        slot = hash & table->slot_mask;
+        while (table->slots[slot] >= 0)
+        {
+            slot = (slot + 1) & table->slot_mask;
+        }
+    }
+    while (table->bytes_size + length > table->bytes_capacity)
+    {
+        table->bytes_capacity *= 2;
+        char *new_bytes = (char *)counted_realloc(table->bytes, table->bytes_capacity);
+        if (new_bytes == NULL)
+        {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        table->bytes = new_bytes;
+    }
+    memcpy(table->bytes + table->bytes_size, bytes, length);
+    table->slots[slot] = table->size;
+    table->chunks[table->size].offset = table->bytes_size;
+    table->chunks[table->size].length = length;
+    table->chunks[table->size].hash = hash;
+    table->counts[table->size] = count;
+    table->bytes_size += length;
+    table->size++;
+}
+
+void init_int_array(IntArray *array, int initial_capacity)
+{
+    init_int_array_in_arena(array, NULL, initial_capacity);
+}
+
+void init_int_array_in_arena(IntArray *array, Arena *arena, int initial_capacity)
+{
+    array->arena = arena;
+    array->ids = (int *)container_alloc(arena, initial_capacity * sizeof(int));
     array->size = 0;
     array->capacity = initial_capacity;
 }
 
-void append_int_array(IntArray *array, int value)
+void append_int_array(IntArray *array, int value)
+{
+    if (array->size == array->capacity)
+    {
+        int capacity = array->capacity > 0 ? 2 * array->capacity : 16;
+        array->ids = (int *)container_realloc(array->arena, array->ids, array->size * sizeof(int), capacity * sizeof(int));
+        array->capacity = capacity;
+    }
+    array->ids[array->size++] = value;
+}
+
+void free_int_array(IntArray *array)
+{
+    container_free(array->arena, array->ids);
+    array->ids = NULL;
+    array->size = 0;
+    array->capacity = 0;
+}
+
+void init_token_span_array(TokenSpanArray *array, int initial_capacity)
+{
+    array->spans = (TokenSpan *)counted_malloc((initial_capacity > 0 ? initial_capacity : 1) * sizeof(TokenSpan));
+    if (array->spans == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    array->size = 0;
+    array->capacity = initial_capacity > 0 ? initial_capacity : 1;
+}
+
+static void reserve_token_span_array(TokenSpanArray *array, int size)
+{
+    if (size <= array->capacity)
+    {
+        return;
+    }
+    int capacity = array->capacity;
+    while (capacity < size)
+    {
+        capacity *= 2;
+    }
+    TokenSpan *spans = (TokenSpan *)counted_realloc(array->spans, capacity * sizeof(TokenSpan));
+    if (spans == NULL)
+    {
+        fprintf(stderr, "Memory reallocation failed\n");
+        exit(1);
+    }
+    array->spans = spans;
+    array->capacity = capacity;
+}
+
+void free_token_span_array(TokenSpanArray *array)
+{
+    free(array->spans);
+    array->spans = NULL;
+    array->size = 0;
+    array->capacity = 0;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Merge kernels replace every occurrence of pair by idx, greedily from the
+// left, compacting ids in place; each returns the new length. The vector
+// kernels test a whole block for pair starts at once, copy blocks without any
+// and pass blocks with matches to merge_block_scalar.
+typedef int (*MergeKernel)(int *ids, int length, Pair pair, int idx);
+
+// Merges ids[i..end) into ids[*write..), reading ids[end] if a pair straddles
+// it. Returns the position after the last element consumed.
+static int merge_block_scalar(int *ids, int length, int i, int end, int *write, Pair pair, int idx)
+{
+    int w = *write;
+    while (i < end)
+    {
+        if (i < length - 1 && ids[i] == pair.first && ids[i + 1] == pair.second)
+        {
+            TRACE(TRACE_LEVEL_CHUNKS, .type = TRACE_MERGE, .pair = pair, .id = idx, .position = i);
+            ids[w++] = idx;
+            i += 2;
+        }
+        else
+        {
+            ids[w++] = ids[i++];
+        }
+    }
+    *write = w;
+    return i;
+}
+
+static int merge_kernel_scalar(int *ids, int length, Pair pair, int idx)
+{
+    int w = 0;
+    merge_block_scalar(ids, length, 0, length, &w, pair, idx);
+    return w;
+}
+
+// Writes only ever land below the read position, and every vector store
+// covers elements already loaded, so compacting in place is safe.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MERGE_KERNELS_X86
+
+__attribute__((target("avx2"))) static int merge_kernel_avx2(int *ids, int length, Pair pair, int idx)
+{
+    __m256i first = _mm256_set1_epi32(pair.first);
+    __m256i second = _mm256_set1_epi32(pair.second);
+    int i = 0;
+    int w = 0;
+    while (i + 8 < length)
+    {
+        __m256i current = _mm256_loadu_si256((const __m256i *)(ids + i));
+        __m256i next = _mm256_loadu_si256((const __m256i *)(ids + i + 1));
+        __m256i hits = _mm256_and_si256(_mm256_cmpeq_epi32(current, first), _mm256_cmpeq_epi32(next, second));
+        if (_mm256_testz_si256(hits, hits))
+        {
+            if (w != i)
+            {
+                _mm256_storeu_si256((__m256i *)(ids + w), current);
+            }
+            w += 8;
+            i += 8;
+        }
+        else
+        {
+            i = merge_block_scalar(ids, length, i, i + 8, &w, pair, idx);
+        }
+    }
+    merge_block_scalar(ids, length, i, length, &w, pair, idx);
+    return w;
+}
+
+__attribute__((target("avx512f"))) static int merge_kernel_avx512(int *ids, int length, Pair pair, int idx)
+{
+    __m512i first = _mm512_set1_epi32(pair.first);
+    __m512i second = _mm512_set1_epi32(pair.second);
+    __m512i token = _mm512_set1_epi32(idx);
+    int i = 0;
+    int w = 0;
+    while (i + 16 < length)
+    {
+        __m512i current = _mm512_loadu_si512((const void *)(ids + i));
+        __m512i next = _mm512_loadu_si512((const void *)(ids + i + 1));
+        unsigned hits = _mm512_mask_cmpeq_epi32_mask(_mm512_cmpeq_epi32_mask(current, first), next, second);
+        if (hits == 0)
+        {
+            if (w != i)
+            {
+                _mm512_storeu_si512((void *)(ids + w), current);
+            }
+            w += 16;
+            i += 16;
+        }
+        else if ((hits & (hits >> 1)) == 0)
+        {
+            // No overlapping matches, so all of them apply: each lane becomes
+            // idx and the lane after it is dropped. A match in the last lane
+            // also consumes ids[i + 16].
+            __mmask16 keep = (__mmask16)~(hits << 1);
+            __m512i merged = _mm512_maskz_compress_epi32(keep, _mm512_mask_mov_epi32(current, (__mmask16)hits, token));
+            _mm512_storeu_si512((void *)(ids + w), merged);
+            w += __builtin_popcount(keep);
+            i += 16 + (hits >> 15);
+        }
+        else
+        {
+            i = merge_block_scalar(ids, length, i, i + 16, &w, pair, idx);
+        }
+    }
+    merge_block_scalar(ids, length, i, length, &w, pair, idx);
+    return w;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define MERGE_KERNEL_NEON
+
+static int merge_kernel_neon(int *ids, int length, Pair pair, int idx)
+{
+    int32x4_t first = vdupq_n_s32(pair.first);
+    int32x4_t second = vdupq_n_s32(pair.second);
+    int i = 0;
+    int w = 0;
+    while (i + 4 < length)
+    {
+        int32x4_t current = vld1q_s32(ids + i);
+        int32x4_t next = vld1q_s32(ids + i + 1);
+        uint32x4_t hits = vandq_u32(vceqq_s32(current, first), vceqq_s32(next, second));
+        if (vmaxvq_u32(hits) == 0)
+        {
+            vst1q_s32(ids + w, current);
+            w += 4;
+            i += 4;
+        }
+        else
+        {
+            i = merge_block_scalar(ids, length, i, i + 4, &w, pair, idx);
+        }
+    }
+    merge_block_scalar(ids, length, i, length, &w, pair, idx);
+    return w;
+}
+#endif
+
+static MergeKernel merge_kernel;
+static pthread_once_t merge_kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_merge_kernel(void)
+{
+    merge_kernel = merge_kernel_scalar;
+#if defined(MERGE_KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        merge_kernel = merge_kernel_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        merge_kernel = merge_kernel_avx2;
+    }
+#elif defined(MERGE_KERNEL_NEON)
+    merge_kernel = merge_kernel_neon;
+#endif
+}
+
+// Replaces every occurrence of pair in ids[0..length) by idx, left to right,
+// and returns the new length. Elements past it are left unspecified.
+int merge_in_place(int *ids, int length, Pair pair, int idx)
+{
+    if (TRACE_ENABLED(TRACE_LEVEL_CHUNKS))
+    {
+        return merge_kernel_scalar(ids, length, pair, idx); // the only kernel reporting each position
+    }
+    pthread_once(&merge_kernel_once, select_merge_kernel);
+    return merge_kernel(ids, length, pair, idx);
+}
+
+void merge(int *ids, int length, Pair pair, int idx, IntArray *result)
+{
+    init_int_array(result, length);
+    memcpy(result->ids, ids, length * sizeof(int));
+    result->size = merge_in_place(result->ids, length, pair, idx);
+}
+
+static void init_encode_cache_shard(EncodeCacheShard *shard, int capacity, bool thread_safe)
+{
+    shard->entries = (EncodeCacheEntry *)counted_malloc(capacity * sizeof(EncodeCacheEntry));
+    int slot_capacity = 2;
+    while (slot_capacity < 2 * capacity)
+    {
+        slot_capacity *= 2;
+    }
+    shard->slots = (int *)counted_malloc(slot_capacity * sizeof(int));
+    if (shard->entries == NULL || shard->slots == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for encode cache\n");
+        exit(1);
+    }
+    memset(shard->slots, -1, slot_capacity * sizeof(int));
+    shard->slot_mask = slot_capacity - 1;
+    shard->size = 0;
+    shard->capacity = capacity;
+    shard->head = -1;
+    shard->tail = -1;
+    shard->hits = 0;
+    shard->misses = 0;
+    if (thread_safe)
+    {
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+}
+
+void init_encode_cache(EncodeCache *cache, int capacity, bool thread_safe)
+{
+    // Locked caches are split so concurrent encoders rarely contend on one mutex
+    cache->num_shards = thread_safe ? ENCODE_CACHE_SHARDS : 1;
+    cache->thread_safe = thread_safe;
+    cache->shards = (EncodeCacheShard *)counted_malloc(cache->num_shards * sizeof(EncodeCacheShard));
+    if (cache->shards == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for encode cache\n");
+        exit(1);
+    }
+    int shard_capacity = (capacity + cache->num_shards - 1) / cache->num_shards;
+    if (shard_capacity < 1)
+    {
+        shard_capacity = 1;
+    }
+    for (int i = 0; i < cache->num_shards; ++i)
+    {
+        init_encode_cache_shard(&cache->shards[i], shard_capacity, thread_safe);
+    }
+}
+
+void free_encode_cache(EncodeCache *cache)
+{
+    for (int i = 0; i < cache->num_shards; ++i)
+    {
+        free(cache->shards[i].entries);
+        free(cache->shards[i].slots);
+        if (cache->thread_safe)
+        {
+            pthread_mutex_destroy(&cache->shards[i].lock);
+        }
+    }
+    free(cache->shards);
+    cache->shards = NULL;
+    cache->num_shards = 0;
+}
+
+// Drops every cached piece, e.g. after the merges changed; counters are kept
+void clear_encode_cache(EncodeCache *cache)
+{
+    for (int i = 0; i < cache->num_shards; ++i)
+    {
+        EncodeCacheShard *shard = &cache->shards[i];
+        if (cache->thread_safe)
+        {
+            pthread_mutex_lock(&shard->lock);
+        }
+        memset(shard->slots, -1, (shard->slot_mask + 1) * sizeof(int));
+        shard->size = 0;
+        shard->head = -1;
+        shard->tail = -1;
+        if (cache->thread_safe)
+        {
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+}
+
+static EncodeCacheShard *encode_cache_shard(EncodeCache *cache, uint32_t hash)
+{
+    // The low bits pick the slot, so the shard comes from the high bits
+    return &cache->shards[(hash >> 24) % cache->num_shards];
+}
+
+static uint32_t find_cache_slot(const EncodeCacheShard *shard, const char *piece, int length, uint32_t hash)
+{
+    uint32_t slot = hash & shard->slot_mask;
+    while (shard->slots[slot] >= 0)
+    {
+        const EncodeCacheEntry *entry = &shard->entries[shard->slots[slot]];
+        if (entry->hash == hash && entry->key_length == length && memcmp(entry->key, piece, length) == 0)
+        {
+            break;
+        }
+        slot = (slot + 1) & shard->slot_mask;
+    }
+    return slot;
+}
+
+static void unlink_cache_entry(EncodeCacheShard *shard, int index)
+{
+    EncodeCacheEntry *entry = &shard->entries[index];
+    if (entry->prev >= 0)
+        shard->entries[entry->prev].next = entry->next;
+    else
+        shard->head = entry->next;
+    if (entry->next >= 0)
+        shard->entries[entry->next].prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+}
+
+static void push_cache_entry_front(EncodeCacheShard *shard, int index)
+{
+    EncodeCacheEntry *entry = &shard->entries[index];
+    entry->prev = -1;
+    entry->next = shard->head;
+    if (shard->head >= 0)
+        shard->entries[shard->head].prev = index;
+    shard->head = index;
+    if (shard->tail < 0)
+        shard->tail = index;
+}
+
+// Backward-shift deletion keeps linear probe chains intact without tombstones
+static void remove_cache_slot(EncodeCacheShard *shard, uint32_t slot)
+{
+    uint32_t hole = slot;
+    uint32_t next = slot;
+    while (1)
+    {
+        next = (next + 1) & shard->slot_mask;
+        if (shard->slots[next] < 0)
+        {
+            break;
+        }
+        uint32_t home = shard->entries[shard->slots[next]].hash & shard->slot_mask;
+        bool stays = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+        if (!stays)
+        {
+            shard->slots[hole] = shard->slots[next];
+            hole = next;
+        }
+    }
+    shard->slots[hole] = -1;
+}
+
+bool encode_cache_lookup(EncodeCache *cache, const char *piece, int length, IntArray *result)
+{
+    if (length > ENCODE_CACHE_MAX_PIECE)
+    {
+        return false;
+    }
+    uint32_t hash = hash_bytes(piece, length);
+    EncodeCacheShard *shard = encode_cache_shard(cache, hash);
+    if (cache->thread_safe)
+    {
+        pthread_mutex_lock(&shard->lock);
+    }
+    int index = shard->slots[find_cache_slot(shard, piece, length, hash)];
+    if (index >= 0)
+    {
+        const EncodeCacheEntry *entry = &shard->entries[index];
+        for (int i = 0; i < entry->num_ids; ++i)
+        {
+            append_int_array(result, entry->ids[i]);
+        }
+        if (shard->head != index)
+        {
+            unlink_cache_entry(shard, index);
+            push_cache_entry_front(shard, index);
+        }
+        shard->hits++;
+    }
+    else
+    {
+        shard->misses++;
+    }
+    if (cache->thread_safe)
+    {
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return index >= 0;
+}
+
+void encode_cache_insert(EncodeCache *cache, const char *piece, int length, const int *ids, int num_ids)
+{
+    if (length > ENCODE_CACHE_MAX_PIECE || num_ids > ENCODE_CACHE_MAX_PIECE)
+    {
+        return;
+    }
+    uint32_t hash = hash_bytes(piece, length);
+    EncodeCacheShard *shard = encode_cache_shard(cache, hash);
+    if (cache->thread_safe)
+    {
+        pthread_mutex_lock(&shard->lock);
+    }
+    uint32_t slot = find_cache_slot(shard, piece, length, hash);
+    // Another thread may have inserted the same piece since our lookup missed
+    if (shard->slots[slot] < 0)
+    {
+        int index;
+        if (shard->size < shard->capacity)
+        {
+            index = shard->size++;
+        }
+        else
+        {
+            // Evict the least recently used piece and reuse its entry
+            index = shard->tail;
+            EncodeCacheEntry *victim = &shard->entries[index];
+            remove_cache_slot(shard, find_cache_slot(shard, victim->key, victim->key_length, victim->hash));
+            unlink_cache_entry(shard, index);
+            slot = find_cache_slot(shard, piece, length, hash);
+        }
+        EncodeCacheEntry *entry = &shard->entries[index];
+        entry->hash = hash;
+        entry->key_length = length;
+        entry->num_ids = num_ids;
+        memcpy(entry->key, piece, length);
+        memcpy(entry->ids, ids, num_ids * sizeof(int));
+        shard->slots[slot] = index;
+        push_cache_entry_front(shard, index);
+    }
+    if (cache->thread_safe)
+    {
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void encode_cache_stats(EncodeCache *cache, long long *hits, long long *misses)
+{
+    *hits = 0;
+    *misses = 0;
+    for (int i = 0; i < cache->num_shards; ++i)
+    {
+        EncodeCacheShard *shard = &cache->shards[i];
+        if (cache->thread_safe)
+        {
+            pthread_mutex_lock(&shard->lock);
+        }
+        *hits += shard->hits;
+        *misses += shard->misses;
+        if (cache->thread_safe)
+        {
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+}
+
+void replace_control_characters(const char *input, char *output, int output_size)
+{
+    int j = 0;
+    for (int i = 0; input[i] != '\0' && j < output_size - 1; ++i)
+    {
+        if (iscntrl((unsigned char)input[i]))
+        {
+            j += snprintf(output + j, output_size - j, "\\u%04x", (unsigned char)input[i]);
+        }
+        else
+        {
+            output[j++] = input[i];
+        }
+    }
+    output[j] = '\0';
+}
+
+void render_token(const char *input, char *output, int output_size)
+{
+    char temp[output_size];
+    snprintf(temp, output_size, "%s", input);
+    replace_control_characters(temp, output, output_size);
+}
+
+#define JIT_STACK_START_SIZE (32 * 1024)
+#define JIT_STACK_MAX_SIZE (1024 * 1024)
+
+// PCRE's default JIT stack is 32 KB on the machine stack, which long pieces
+// overflow. Every thread gets one larger stack, shared by all tokenizers and
+// freed when the thread exits.
+static pthread_key_t jit_stack_key;
+static pthread_once_t jit_stack_once = PTHREAD_ONCE_INIT;
+
+static void free_jit_stack(void *stack)
+{
+    pcre_jit_stack_free((pcre_jit_stack *)stack);
+}
+
+static void create_jit_stack_key(void)
+{
+    pthread_key_create(&jit_stack_key, free_jit_stack);
+}
+
+static pcre_jit_stack *thread_jit_stack(void *data)
+{
+    (void)data;
+    pthread_once(&jit_stack_once, create_jit_stack_key);
+    pcre_jit_stack *stack = (pcre_jit_stack *)pthread_getspecific(jit_stack_key);
+    if (stack == NULL)
+    {
+        stack = pcre_jit_stack_alloc(JIT_STACK_START_SIZE, JIT_STACK_MAX_SIZE);
+        if (stack == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for JIT stack\n");
+            exit(1);
+        }
+        pthread_setspecific(jit_stack_key, stack);
+    }
+    return stack;
+}
+
+static bool gpt2_scanner_matches_pcre(void); // defined with the scanner below
+
+// Compiles tokenizer->pattern and picks the scanner that splits text with it
+static void compile_pattern(RegexTokenizer *tokenizer)
+{
+    const char *error;
+    int erroffset;
+    tokenizer->compiled_pattern = pcre_compile(
+        tokenizer->pattern,
+        PCRE_UTF8,
+        &error,
+        &erroffset,
+        NULL);
+    if (tokenizer->compiled_pattern == NULL)
+    {
+        fprintf(stderr, "PCRE compilation failed at offset %d: %s\n", erroffset, error);
+        exit(1);
+    }
+
+    tokenizer->compiled_pattern_extra = pcre_study(tokenizer->compiled_pattern, PCRE_STUDY_JIT_COMPILE, &error);
+    if (error != NULL)
+    {
+        fprintf(stderr, "PCRE study failed: %s\n", error);
+        exit(1);
+    }
+    if (tokenizer->compiled_pattern_extra != NULL)
+    {
+        pcre_assign_jit_stack(tokenizer->compiled_pattern_extra, thread_jit_stack, NULL);
+    }
+    tokenizer->split_scanner =
+        strcmp(tokenizer->pattern, GPT2_SPLIT_PATTERN) == 0 && gpt2_scanner_matches_pcre() ? SPLIT_SCANNER_GPT2 : SPLIT_SCANNER_PCRE;
+}
+
+static void create_metrics_recorder(RegexTokenizer *tokenizer)
+{
+    tokenizer->metrics = (MetricsRecorder *)counted_calloc(1, sizeof(MetricsRecorder));
+    if (tokenizer->metrics == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for metrics\n");
+        exit(1);
+    }
+}
+
+static void create_tokenizer_cache(RegexTokenizer *tokenizer, int cache_capacity, bool thread_safe_cache)
+{
+    tokenizer->cache = NULL;
+    if (cache_capacity > 0)
+    {
+        tokenizer->cache = (EncodeCache *)counted_malloc(sizeof(EncodeCache));
+        if (tokenizer->cache == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for encode cache\n");
+            exit(1);
+        }
+        init_encode_cache(tokenizer->cache, cache_capacity, thread_safe_cache);
+    }
+}
+
+// Appends special tokens without validating them
+static void append_special_tokens(RegexTokenizer *tokenizer, const char *const *literals, const int *ids, int count)
+{
+    int size = tokenizer->special_size + count;
+    size_t old_bytes = tokenizer->special_size > 0 ? tokenizer->special_offsets[tokenizer->special_size] : 0;
+    size_t new_bytes = old_bytes;
+    for (int i = 0; i < count; ++i)
+    {
+        new_bytes += strlen(literals[i]);
+    }
+    int *special_tokens = (int *)counted_realloc(tokenizer->special_tokens, (size > 0 ? size : 1) * sizeof(int));
+    size_t *special_offsets = (size_t *)counted_realloc(tokenizer->special_offsets, (size + 1) * sizeof(size_t));
+    char *special_bytes = (char *)counted_realloc(tokenizer->special_bytes, new_bytes > 0 ? new_bytes : 1);
+    if (special_tokens == NULL || special_offsets == NULL || special_bytes == NULL)
+    {
+        fprintf(stderr, "Memory reallocation failed\n");
+        exit(1);
+    }
+    special_offsets[0] = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        int index = tokenizer->special_size + i;
+        size_t length = strlen(literals[i]);
+        special_tokens[index] = ids[i];
+        memcpy(special_bytes + special_offsets[index], literals[i], length);
+        special_offsets[index + 1] = special_offsets[index] + length;
+    }
+    tokenizer->special_tokens = special_tokens;
+    tokenizer->special_offsets = special_offsets;
+    tokenizer->special_bytes = special_bytes;
+    tokenizer->special_size = size;
+    tokenizer->special_capacity = size;
+}
+
+static void free_special_matcher(SpecialMatcher *matcher)
+{
+    free(matcher->root_next);
+    free(matcher->edge_begin);
+    free(matcher->edge_bytes);
+    free(matcher->edge_targets);
+    free(matcher->fail);
+    free(matcher->depth);
+    free(matcher->token);
+    free(matcher->dict_link);
+    memset(matcher, 0, sizeof(SpecialMatcher));
+}
+
+static inline int special_matcher_step(const SpecialMatcher *matcher, int state, unsigned char byte)
+{
+    while (state != 0)
+    {
+        int lo = matcher->edge_begin[state];
+        int hi = matcher->edge_begin[state + 1] - 1;
+        while (lo <= hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (matcher->edge_bytes[mid] < byte)
+                lo = mid + 1;
+            else if (matcher->edge_bytes[mid] > byte)
+                hi = mid - 1;
+            else
+                return matcher->edge_targets[mid];
+        }
+        state = matcher->fail[state];
+    }
+    return matcher->root_next[byte];
+}
+
+typedef struct
+{
+    const unsigned char *bytes;
+    size_t length;
+    int index;
+} SpecialLiteral;
+
+static int compare_special_literals(const void *a, const void *b)
+{
+    const SpecialLiteral *x = (const SpecialLiteral *)a;
+    const SpecialLiteral *y = (const SpecialLiteral *)b;
+    int order = memcmp(x->bytes, y->bytes, x->length < y->length ? x->length : y->length);
+    if (order != 0)
+        return order;
+    return (x->length > y->length) - (x->length < y->length);
+}
+
+// Why a set of special tokens cannot be used together, or NULL. Ids must be
+// at least min_id, past the byte and merge ids; literals must not hold a line
+// break, since text models store one per line; and no id or literal may
+// repeat. Empty literals, left by models from before literals, never clash.
+// Sorts both arrays.
+static const char *check_special_tokens(SpecialLiteral *literals, int *ids, int count, int min_id)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        if (ids[i] < min_id)
+            return "special token id taken by a byte or merge";
+        if (memchr(literals[i].bytes, '\n', literals[i].length) || memchr(literals[i].bytes, '\r', literals[i].length))
+            return "special token literal holds a line break";
+    }
+    qsort(literals, count, sizeof(SpecialLiteral), compare_special_literals);
+    qsort(ids, count, sizeof(int), compare_ints);
+    for (int i = 1; i < count; ++i)
+    {
+        if (ids[i] == ids[i - 1])
+            return "special token id given twice";
+        if (literals[i].length > 0 && compare_special_literals(&literals[i], &literals[i - 1]) == 0)
+            return "special token literal given twice";
+    }
+    return NULL;
+}
+
+static void *matcher_alloc(size_t size)
+{
+    void *memory = counted_malloc(size > 0 ? size : 1);
+    if (memory == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for special token matcher\n");
+        exit(1);
+    }
+    return memory;
+}
+
+// Builds the automaton over the special token literals. The literals are
+// inserted in sorted order, so each one shares exactly its common prefix with
+// the previous one, and the edges of every state come out sorted by byte.
+static void build_special_matcher(RegexTokenizer *tokenizer)
+{
+    SpecialMatcher *matcher = &tokenizer->special_matcher;
+    free_special_matcher(matcher);
+    int count = tokenizer->special_size;
+    if (count == 0)
+    {
+        return;
+    }
+
+    SpecialLiteral *literals = (SpecialLiteral *)matcher_alloc(count * sizeof(SpecialLiteral));
+    size_t max_length = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        literals[i].bytes = (const unsigned char *)tokenizer->special_bytes + tokenizer->special_offsets[i];
+        literals[i].length = tokenizer->special_offsets[i + 1] - tokenizer->special_offsets[i];
+        literals[i].index = i;
+        if (literals[i].length > max_length)
+        {
+            max_length = literals[i].length;
+        }
+    }
+    qsort(literals, count, sizeof(SpecialLiteral), compare_special_literals);
+
+    int max_states = (int)tokenizer->special_offsets[count] + 1;
+    matcher->depth = (int *)matcher_alloc(max_states * sizeof(int));
+    matcher->token = (int *)matcher_alloc(max_states * sizeof(int));
+    int *edge_parents = (int *)matcher_alloc(max_states * sizeof(int));
+    unsigned char *edge_bytes = (unsigned char *)matcher_alloc(max_states);
+    int *edge_children = (int *)matcher_alloc(max_states * sizeof(int));
+    int *path = (int *)matcher_alloc((max_length + 1) * sizeof(int));
+    int num_states = 1;
+    int num_edges = 0;
+    matcher->depth[0] = 0;
+    matcher->token[0] = -1;
+    path[0] = 0;
+    const SpecialLiteral *previous = NULL;
+    for (int i = 0; i < count; ++i)
+    {
+        const SpecialLiteral *literal = &literals[i];
+        if (literal->length == 0)
+        {
+            continue; // Never matches; only tokens loaded without a literal are empty
+        }
+        size_t shared = 0;
+        while (previous && shared < previous->length && shared < literal->length && previous->bytes[shared] == literal->bytes[shared])
+        {
+            shared++;
+        }
+        for (size_t d = shared; d < literal->length; ++d)
+        {
+            int state = num_states++;
+            matcher->depth[state] = (int)d + 1;
+            matcher->token[state] = -1;
+            edge_parents[num_edges] = path[d];
+            edge_bytes[num_edges] = literal->bytes[d];
+            edge_children[num_edges] = state;
+            num_edges++;
+            path[d + 1] = state;
+        }
+        matcher->token[path[literal->length]] = literal->index;
+        previous = literal;
+    }
+    free(path);
+    free(literals);
+
+    // Group the edges by parent, keeping their byte order
+    matcher->num_states = num_states;
+    matcher->edge_begin = (int *)matcher_alloc((num_states + 1) * sizeof(int));
+    matcher->edge_bytes = (unsigned char *)matcher_alloc(num_edges);
+    matcher->edge_targets = (int *)matcher_alloc(num_edges * sizeof(int));
+    matcher->root_next = (int *)matcher_alloc(256 * sizeof(int));
+    memset(matcher->edge_begin, 0, (num_states + 1) * sizeof(int));
+    memset(matcher->root_next, 0, 256 * sizeof(int));
+    for (int e = 0; e < num_edges; ++e)
+    {
+        matcher->edge_begin[edge_parents[e] + 1]++;
+    }
+    for (int s = 0; s < num_states; ++s)
+    {
+        matcher->edge_begin[s + 1] += matcher->edge_begin[s];
+    }
+    int *fill = (int *)matcher_alloc(num_states * sizeof(int));
+    memcpy(fill, matcher->edge_begin, num_states * sizeof(int));
+    for (int e = 0; e < num_edges; ++e)
+    {
+        int slot = fill[edge_parents[e]]++;
+        matcher->edge_bytes[slot] = edge_bytes[e];
+        matcher->edge_targets[slot] = edge_children[e];
+        if (edge_parents[e] == 0)
+        {
+            matcher->root_next[edge_bytes[e]] = edge_children[e];
+        }
+    }
+    free(fill);
+    free(edge_parents);
+    free(edge_bytes);
+    free(edge_children);
+
+    // Failure and dictionary links in breadth-first order, so the links of
+    // shallower states are ready when a state needs them
+    matcher->fail = (int *)matcher_alloc(num_states * sizeof(int));
+    matcher->dict_link = (int *)matcher_alloc(num_states * sizeof(int));
+    int *queue = (int *)matcher_alloc(num_states * sizeof(int));
+    int head = 0;
+    int tail = 0;
+    matcher->fail[0] = 0;
+    matcher->dict_link[0] = -1;
+    queue[tail++] = 0;
+    while (head < tail)
+    {
+        int state = queue[head++];
+        for (int e = matcher->edge_begin[state]; e < matcher->edge_begin[state + 1]; ++e)
+        {
+            int child = matcher->edge_targets[e];
+            int fail = state == 0 ? 0 : special_matcher_step(matcher, matcher->fail[state], matcher->edge_bytes[e]);
+            matcher->fail[child] = fail;
+            matcher->dict_link[child] = matcher->token[fail] >= 0 ? fail : matcher->dict_link[fail];
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+}
+
+void init_regex_tokenizer(RegexTokenizer *tokenizer, const char *pattern)
+{
+    init_regex_tokenizer_with_cache(tokenizer, pattern, 0, false);
+}
+
+void init_regex_tokenizer_with_cache(RegexTokenizer *tokenizer, const char *pattern, int cache_capacity, bool thread_safe_cache)
+{
+    tokenizer->merges = NULL;
+    tokenizer->merge_size = 0;
+    tokenizer->merge_capacity = 256;
+    tokenizer->merges = (Pair *)counted_malloc(tokenizer->merge_capacity * sizeof(Pair));
+    if (tokenizer->merges == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for merges\n");
+        exit(1);
+    }
+    tokenizer->pattern = counted_strdup(pattern);
+    if (tokenizer->pattern == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for pattern\n");
+        exit(1);
+    }
+
+    compile_pattern(tokenizer);
+
+    tokenizer->merge_slots = NULL;
+    tokenizer->merge_slot_mask = 0;
+    create_tokenizer_cache(tokenizer, cache_capacity, thread_safe_cache);
+    tokenizer->special_tokens = NULL;
+    tokenizer->special_bytes = NULL;
+    tokenizer->special_offsets = NULL;
+    tokenizer->special_size = 0;
+    tokenizer->special_capacity = 0;
+    memset(&tokenizer->special_matcher, 0, sizeof(SpecialMatcher));
+    tokenizer->vocab_bytes = NULL;
+    tokenizer->vocab_offsets = NULL;
+    tokenizer->vocab_size = 0;
+    tokenizer->mapping = NULL;
+    tokenizer->mapping_size = 0;
+    create_metrics_recorder(tokenizer);
+    build_vocab(tokenizer);
+}
+
+void free_regex_tokenizer(RegexTokenizer *tokenizer)
+{
+    if (tokenizer->mapping)
+    {
+        // Everything but the cache, the special token matcher and the compiled
+        // pattern lives in the mapping
+        munmap(tokenizer->mapping, tokenizer->mapping_size);
+    }
+    else
+    {
+        free(tokenizer->pattern);
+        free(tokenizer->special_tokens);
+        free(tokenizer->special_bytes);
+        free(tokenizer->special_offsets);
+        free(tokenizer->vocab_bytes);
+        free(tokenizer->vocab_offsets);
+        if (tokenizer->merges)
+        {
+            free(tokenizer->merges);
+        }
+        free(tokenizer->merge_slots);
+    }
+    if (tokenizer->cache)
+    {
+        free_encode_cache(tokenizer->cache);
+        free(tokenizer->cache);
+    }
+    free_special_matcher(&tokenizer->special_matcher);
+    free(tokenizer->metrics);
+    if (tokenizer->compiled_pattern)
+    {
+        pcre_free(tokenizer->compiled_pattern);
+    }
+    if (tokenizer->compiled_pattern_extra)
+    {
+        pcre_free_study(tokenizer->compiled_pattern_extra);
+    }
+}
+
+// Lays out the bytes of every token id back to back in one arena. Token i
+// spans vocab_bytes[vocab_offsets[i], vocab_offsets[i + 1]); ids that are not
+// assigned have an empty span.
+void build_vocab(RegexTokenizer *tokenizer)
+{
+    int vocab_size = 256 + tokenizer->merge_size;
+    for (int i = 0; i < tokenizer->special_size; ++i)
+    {
+        if (tokenizer->special_tokens[i] >= vocab_size)
+        {
+            vocab_size = tokenizer->special_tokens[i] + 1;
+        }
+    }
+    size_t *offsets = (size_t *)counted_malloc((vocab_size + 1) * sizeof(size_t));
+    if (offsets == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for vocab\n");
+        exit(1);
+    }
+
+    // First pass: token lengths, stored one slot ahead so the prefix sum below
+    // turns them into offsets in place
+    memset(offsets, 0, (vocab_size + 1) * sizeof(size_t));
+    for (int i = 0; i < 256; ++i)
+    {
+        offsets[i + 1] = 1;
+    }
+    for (int i = 0; i < tokenizer->merge_size; ++i)
+    {
+        Pair pair = tokenizer->merges[i];
+        int idx = 256 + i;
+        if (pair.first < 0 || pair.first >= idx || pair.second < 0 || pair.second >= idx)
+        {
+            fprintf(stderr, "Invalid merge (%d, %d) for token id %d\n", pair.first, pair.second, idx);
+            continue;
+        }
+        offsets[idx + 1] = offsets[pair.first + 1] + offsets[pair.second + 1];
+    }
+    for (int i = 0; i < tokenizer->special_size; ++i)
+    {
+        int idx = tokenizer->special_tokens[i];
+        if (idx < 256 + tokenizer->merge_size)
+        {
+            // Callers reject these; the merge's bytes are kept rather than overwritten
+            fprintf(stderr, "Special token id %d is taken by a byte or merge\n", idx);
+            continue;
+        }
+        offsets[idx + 1] = tokenizer->special_offsets[i + 1] - tokenizer->special_offsets[i];
+    }
+    for (int i = 0; i < vocab_size; ++i)
+    {
+        offsets[i + 1] += offsets[i];
+    }
+
+    char *bytes = (char *)counted_malloc(offsets[vocab_size] > 0 ? offsets[vocab_size] : 1);
+    if (bytes == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for vocab\n");
+        exit(1);
+    }
+    for (int i = 0; i < 256; ++i)
+    {
+        bytes[offsets[i]] = (char)i;
+    }
+    for (int i = 0; i < tokenizer->merge_size; ++i)
+    {
+        Pair pair = tokenizer->merges[i];
+        int idx = 256 + i;
+        if (offsets[idx + 1] == offsets[idx])
+        {
+            continue;
+        }
+        size_t first_length = offsets[pair.first + 1] - offsets[pair.first];
+        memcpy(bytes + offsets[idx], bytes + offsets[pair.first], first_length);
+        memcpy(bytes + offsets[idx] + first_length, bytes + offsets[pair.second], offsets[pair.second + 1] - offsets[pair.second]);
+    }
+    for (int i = 0; i < tokenizer->special_size; ++i)
+    {
+        int idx = tokenizer->special_tokens[i];
+        if (idx >= 256 + tokenizer->merge_size)
+        {
+            memcpy(bytes + offsets[idx], tokenizer->special_bytes + tokenizer->special_offsets[i], offsets[idx + 1] - offsets[idx]);
+        }
+    }
+
+    free(tokenizer->vocab_bytes);
+    free(tokenizer->vocab_offsets);
+    tokenizer->vocab_bytes = bytes;
+    tokenizer->vocab_offsets = offsets;
+    tokenizer->vocab_size = vocab_size;
+}
+
+void build_merge_ranks(RegexTokenizer *tokenizer)
+{
+    free(tokenizer->merge_slots);
+    int slot_capacity = 2;
+    while (slot_capacity < 2 * tokenizer->merge_size)
+    {
+        slot_capacity *= 2;
+    }
+    tokenizer->merge_slots = (int *)counted_malloc(slot_capacity * sizeof(int));
+    if (tokenizer->merge_slots == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for merge ranks\n");
+        exit(1);
+    }
+    memset(tokenizer->merge_slots, -1, slot_capacity * sizeof(int));
+    tokenizer->merge_slot_mask = slot_capacity - 1;
+    for (int rank = 0; rank < tokenizer->merge_size; ++rank)
+    {
+        Pair pair = tokenizer->merges[rank];
+        uint32_t slot = hash_pair(pair) & tokenizer->merge_slot_mask;
+        while (tokenizer->merge_slots[slot] >= 0)
+        {
+            Pair candidate = tokenizer->merges[tokenizer->merge_slots[slot]];
+            if (candidate.first == pair.first && candidate.second == pair.second)
+            {
+                break; // Keep the lowest rank of a repeated pair
+            }
+            slot = (slot + 1) & tokenizer->merge_slot_mask;
+        }
+        if (tokenizer->merge_slots[slot] < 0)
+        {
+            tokenizer->merge_slots[slot] = rank;
+        }
+    }
+}
+
+int find_merge_rank(const RegexTokenizer *tokenizer, Pair pair)
+{
+    if (tokenizer->merge_slots == NULL)
+    {
+        return -1;
+    }
+    uint32_t slot = hash_pair(pair) & tokenizer->merge_slot_mask;
+    int rank;
+    while ((rank = tokenizer->merge_slots[slot]) >= 0)
+    {
+        Pair candidate = tokenizer->merges[rank];
+        if (candidate.first == pair.first && candidate.second == pair.second)
+        {
+            return rank;
+        }
+        slot = (slot + 1) & tokenizer->merge_slot_mask;
+    }
+    return -1;
+}
+
+// Registers special tokens such as "<|endoftext|>". Their ids must come
+// after the merged tokens, and ids and literals must be unique and non-empty.
+// If any token is invalid, nothing is registered.
+bool register_special_tokens(RegexTokenizer *tokenizer, const char *const *literals, const int *ids, int count)
+{
+    if (tokenizer->mapping)
+    {
+        fprintf(stderr, "Cannot register special tokens in a tokenizer mapped from a binary model\n");
+        return false;
+    }
+    int total = tokenizer->special_size + count;
+    SpecialLiteral *all = (SpecialLiteral *)matcher_alloc(total * sizeof(SpecialLiteral));
+    int *all_ids = (int *)matcher_alloc(total * sizeof(int));
+    bool valid = true;
+    for (int i = 0; i < total && valid; ++i)
+    {
+        bool existing = i < tokenizer->special_size;
+        int id = existing ? tokenizer->special_tokens[i] : ids[i - tokenizer->special_size];
+        all[i].bytes = existing ? (const unsigned char *)tokenizer->special_bytes + tokenizer->special_offsets[i]
+                                : (const unsigned char *)literals[i - tokenizer->special_size];
+        all[i].length = existing ? tokenizer->special_offsets[i + 1] - tokenizer->special_offsets[i] : strlen(literals[i - tokenizer->special_size]);
+        all[i].index = i;
+        all_ids[i] = id;
+        if (!existing && all[i].length == 0)
+        {
+            fprintf(stderr, "Invalid special token \"\" with id %d\n", id);
+            valid = false;
+        }
+    }
+    const char *error = valid ? check_special_tokens(all, all_ids, total, 256 + tokenizer->merge_size) : NULL;
+    if (error)
+    {
+        fprintf(stderr, "Cannot register special tokens: %s\n", error);
+        valid = false;
+    }
+    free(all);
+    free(all_ids);
+    if (!valid)
+    {
+        return false;
+    }
+
+    append_special_tokens(tokenizer, literals, ids, count);
+    build_vocab(tokenizer);
+    build_special_matcher(tokenizer);
+    return true;
+}
+
+static char *strip_newline(char *line)
+{
+    size_t length = strlen(line);
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    {
+        line[--length] = '\0';
+    }
+    return line;
+}
+
+void save_tokenizer(RegexTokenizer *tokenizer, const char *file_prefix)
+{
+    char model_file[256];
+    snprintf(model_file, sizeof(model_file), "%s.model", file_prefix);
+    FILE *f = fopen(model_file, "w");
+    if (!f)
+    {
+        perror("Failed to open model file");
+        return;
+    }
+    fprintf(f, "minbpe v1\n");
+    fprintf(f, "%s\n", tokenizer->pattern);
+    fprintf(f, "%d\n", tokenizer->special_size);
+    for (int i = 0; i < tokenizer->special_size; ++i)
+    {
+        size_t offset = tokenizer->special_offsets[i];
+        fprintf(f, "%.*s %d\n", (int)(tokenizer->special_offsets[i + 1] - offset), tokenizer->special_bytes + offset,
+                tokenizer->special_tokens[i]);
+    }
+    for (int i = 0; i < tokenizer->merge_size; ++i)
+    {
+        fprintf(f, "%d %d\n", tokenizer->merges[i].first, tokenizer->merges[i].second);
+    }
+    fclose(f);
+}
+
+// Takes ownership of pattern, a malloc'd string
+static void replace_pattern(RegexTokenizer *tokenizer, char *pattern)
+{
+    free(tokenizer->pattern);
+    tokenizer->pattern = pattern;
+    pcre_free(tokenizer->compiled_pattern);
+    if (tokenizer->compiled_pattern_extra)
+    {
+        pcre_free_study(tokenizer->compiled_pattern_extra);
+    }
+    compile_pattern(tokenizer);
+}
+
+// Reads the merges after the special tokens, one "<first> <second>" line each
+static Pair *read_model_merges(FILE *f, int *count, int *capacity)
+{
+    *capacity = 256;
+    Pair *merges = (Pair *)counted_malloc(*capacity * sizeof(Pair));
+    if (merges == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for merges\n");
+        exit(1);
+    }
+    *count = 0;
+    Pair pair;
+    while (fscanf(f, "%d %d", &pair.first, &pair.second) == 2)
+    {
+        if (*count == *capacity)
+        {
+            *capacity *= 2;
+            Pair *new_merges = (Pair *)counted_realloc(merges, *capacity * sizeof(Pair));
+            if (new_merges == NULL)
+            {
+                fprintf(stderr, "Memory reallocation failed\n");
+                exit(1);
+            }
+            merges = new_merges;
+        }
+        merges[(*count)++] = pair;
+    }
+    return merges;
+}
+
+// Replaces the tokenizer's pattern, special tokens and merges with those of
+// a file written by save_tokenizer. The whole file is read and checked
+// first: a merge of ids not yet defined, or a special token id that a merge
+// also takes, rejects it. Returns false, leaving the tokenizer unchanged, if
+// the file cannot be read or is invalid.
+bool load_tokenizer(RegexTokenizer *tokenizer, const char *model_file)
+{
+    if (tokenizer->mapping)
+    {
+        fprintf(stderr, "Cannot load into a tokenizer mapped from a binary model\n");
+        return false;
+    }
+    FILE *f = fopen(model_file, "r");
+    if (!f)
+    {
+        perror("Failed to open model file");
+        return false;
+    }
+    // Both the version and the pattern are whole lines; the pattern may contain spaces
+    char *line = NULL;
+    size_t line_size = 0;
+    if (getline(&line, &line_size, f) < 0 || strcmp(strip_newline(line), "minbpe v1") != 0)
+    {
+        fprintf(stderr, "Unsupported version: %s\n", line ? line : "");
+        free(line);
+        fclose(f);
+        return false;
+    }
+    if (getline(&line, &line_size, f) < 0)
+    {
+        fprintf(stderr, "Model file ends before the pattern\n");
+        free(line);
+        fclose(f);
+        return false;
+    }
+    char *pattern = strip_newline(line);
+    line = NULL; // The pattern keeps this buffer
+    line_size = 0;
+
+    int num_special;
+    if (getline(&line, &line_size, f) < 0 || sscanf(line, "%d", &num_special) != 1 || num_special < 0)
+    {
+        fprintf(stderr, "Invalid special token count in model file\n");
+        free(line);
+        free(pattern);
+        fclose(f);
+        return false;
+    }
+    // Each special token is a line "<literal> <id>"; files from before special
+    // tokens had literals hold just the id
+    char **literals = (char **)counted_calloc(num_special > 0 ? num_special : 1, sizeof(char *));
+    int *special_ids = (int *)counted_calloc(num_special > 0 ? num_special : 1, sizeof(int));
+    if (literals == NULL || special_ids == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    int num_read = 0;
+    while (num_read < num_special && getline(&line, &line_size, f) >= 0)
+    {
+        strip_newline(line);
+        char *space = strrchr(line, ' ');
+        literals[num_read] = line;
+        if (space != NULL)
+        {
+            *space = '\0';
+        }
+        special_ids[num_read] = atoi(space != NULL ? space + 1 : line);
+        if (space == NULL)
+        {
+            line[0] = '\0';
+        }
+        num_read++;
+        line = NULL; // The literal keeps this buffer
+        line_size = 0;
+    }
+    free(line);
+    int num_merges;
+    int merge_capacity;
+    Pair *merges = read_model_merges(f, &num_merges, &merge_capacity);
+    fclose(f);
+
+    bool ok = true;
+    if (num_read < num_special)
+    {
+        fprintf(stderr, "Model file ends before its special tokens\n");
+        ok = false;
+    }
+    for (int i = 0; ok && i < num_merges; ++i)
+    {
+        int idx = 256 + i;
+        if (merges[i].first < 0 || merges[i].first >= idx || merges[i].second < 0 || merges[i].second >= idx)
+        {
+            fprintf(stderr, "Invalid merge (%d, %d) for token id %d\n", merges[i].first, merges[i].second, idx);
+            ok = false;
+        }
+    }
+    if (ok && num_read > 0)
+    {
+        SpecialLiteral *sorted = (SpecialLiteral *)matcher_alloc(num_read * sizeof(SpecialLiteral));
+        int *sorted_ids = (int *)matcher_alloc(num_read * sizeof(int));
+        for (int i = 0; i < num_read; ++i)
+        {
+            sorted[i] = (SpecialLiteral){(const unsigned char *)literals[i], strlen(literals[i]), i};
+            sorted_ids[i] = special_ids[i];
+        }
+        const char *error = check_special_tokens(sorted, sorted_ids, num_read, 256 + num_merges);
+        if (error)
+        {
+            fprintf(stderr, "Invalid model file: %s\n", error);
+            ok = false;
+        }
+        free(sorted);
+        free(sorted_ids);
+    }
+
+    if (ok)
+    {
+        replace_pattern(tokenizer, pattern);
+        pattern = NULL;
+        tokenizer->special_size = 0;
+        append_special_tokens(tokenizer, (const char *const *)literals, special_ids, num_read);
+        free(tokenizer->merges);
+        tokenizer->merges = merges;
+        tokenizer->merge_size = num_merges;
+        tokenizer->merge_capacity = merge_capacity;
+        merges = NULL;
+        build_vocab(tokenizer);
+        build_merge_ranks(tokenizer);
+        build_special_matcher(tokenizer);
+        if (tokenizer->cache)
+        {
+            clear_encode_cache(tokenizer->cache);
+        }
+    }
+    for (int i = 0; i < num_read; ++i)
+    {
+        free(literals[i]);
+    }
+    free(literals);
+    free(special_ids);
+    free(merges);
+    free(pattern);
+    return ok;
+}
+
+// Binary model layout, version 2. A fixed header is followed by sections at
+// 8-byte aligned offsets, each stored exactly like the corresponding array of
+// a RegexTokenizer, so a mapped file is used in place:
+//   merges          merge_size Pair
+//   special tokens  special_size int
+//   special offsets special_size + 1 uint64_t
+//   special bytes   special_offsets[special_size] bytes, the literals
+//   merge slots     merge_slot_count int, the rank table of build_merge_ranks
+//   vocab offsets   vocab_size + 1 uint64_t
+//   vocab bytes     vocab_offsets[vocab_size] bytes
+//   pattern         pattern_length bytes and a NUL
+// The slots depend on hash_pair, so changing it needs a new version. Files are
+// in host byte order; byte_order rejects files written with the other one.
+#define BINARY_MODEL_MAGIC "MINBPEB"
+#define BINARY_MODEL_VERSION 2 // 1 had no special token literals
+#define BINARY_MODEL_BYTE_ORDER 0x01020304u
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t merge_size;
+    uint32_t special_size;
+    uint32_t merge_slot_count;
+    uint32_t vocab_size;
+    uint32_t pattern_length;
+    uint64_t merges_offset;
+    uint64_t special_offset;
+    uint64_t special_offsets_offset;
+    uint64_t special_bytes_offset;
+    uint64_t slots_offset;
+    uint64_t vocab_offsets_offset;
+    uint64_t vocab_bytes_offset;
+    uint64_t pattern_offset;
+    uint64_t file_size;
+    uint64_t checksum; // FNV-1a over the 64-bit words after the header
+} BinaryModelHeader;
+
+static uint64_t align_model_offset(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+static uint64_t checksum_model_words(const char *data, uint64_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint64_t i = 0; i < length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool save_tokenizer_binary(const RegexTokenizer *tokenizer, const char *model_file)
+{
+    int empty_slots[2] = {-1, -1};
+    const int *slots = tokenizer->merge_slots ? tokenizer->merge_slots : empty_slots;
+    size_t special_bytes_size = tokenizer->special_size > 0 ? tokenizer->special_offsets[tokenizer->special_size] : 0;
+    BinaryModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_MODEL_MAGIC, sizeof(header.magic));
+    header.version = BINARY_MODEL_VERSION;
+    header.byte_order = BINARY_MODEL_BYTE_ORDER;
+    header.header_size = sizeof(BinaryModelHeader);
+    header.merge_size = tokenizer->merge_size;
+    header.special_size = tokenizer->special_size;
+    header.merge_slot_count = tokenizer->merge_slots ? tokenizer->merge_slot_mask + 1 : 2;
+    header.vocab_size = tokenizer->vocab_size;
+    header.pattern_length = strlen(tokenizer->pattern);
+    header.merges_offset = align_model_offset(sizeof(BinaryModelHeader));
+    header.special_offset = align_model_offset(header.merges_offset + (uint64_t)header.merge_size * sizeof(Pair));
+    header.special_offsets_offset = align_model_offset(header.special_offset + (uint64_t)header.special_size * sizeof(int));
+    header.special_bytes_offset = align_model_offset(header.special_offsets_offset + ((uint64_t)header.special_size + 1) * sizeof(uint64_t));
+    header.slots_offset = align_model_offset(header.special_bytes_offset + special_bytes_size);
+    header.vocab_offsets_offset = align_model_offset(header.slots_offset + (uint64_t)header.merge_slot_count * sizeof(int));
+    header.vocab_bytes_offset = align_model_offset(header.vocab_offsets_offset + ((uint64_t)header.vocab_size + 1) * sizeof(uint64_t));
+    header.pattern_offset = align_model_offset(header.vocab_bytes_offset + tokenizer->vocab_offsets[tokenizer->vocab_size]);
+    header.file_size = align_model_offset(header.pattern_offset + header.pattern_length + 1);
+
+    // Sections and padding are assembled in one zeroed buffer and written at once
+    char *data = (char *)counted_calloc(header.file_size, 1);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for binary model\n");
+        exit(1);
+    }
+    memcpy(data + header.merges_offset, tokenizer->merges, (size_t)header.merge_size * sizeof(Pair));
+    if (header.special_size > 0)
+    {
+        memcpy(data + header.special_offset, tokenizer->special_tokens, (size_t)header.special_size * sizeof(int));
+    }
+    for (uint32_t i = 0; i <= header.special_size; ++i)
+    {
+        uint64_t offset = header.special_size > 0 ? tokenizer->special_offsets[i] : 0;
+        memcpy(data + header.special_offsets_offset + i * sizeof(uint64_t), &offset, sizeof(uint64_t));
+    }
+    if (special_bytes_size > 0)
+    {
+        memcpy(data + header.special_bytes_offset, tokenizer->special_bytes, special_bytes_size);
+    }
+    memcpy(data + header.slots_offset, slots, (size_t)header.merge_slot_count * sizeof(int));
+    for (uint32_t i = 0; i <= header.vocab_size; ++i)
+    {
+        uint64_t offset = tokenizer->vocab_offsets[i];
+        memcpy(data + header.vocab_offsets_offset + i * sizeof(uint64_t), &offset, sizeof(uint64_t));
+    }
+    memcpy(data + header.vocab_bytes_offset, tokenizer->vocab_bytes, tokenizer->vocab_offsets[tokenizer->vocab_size]);
+    memcpy(data + header.pattern_offset, tokenizer->pattern, header.pattern_length);
+    header.checksum = checksum_model_words(data + sizeof(BinaryModelHeader), header.file_size - sizeof(BinaryModelHeader));
+    memcpy(data, &header, sizeof(header));
+
+    FILE *f = fopen(model_file, "wb");
+    if (!f)
+    {
+        perror("Failed to open model file");
+        free(data);
+        return false;
+    }
+    bool ok = fwrite(data, 1, header.file_size, f) == header.file_size;
+    ok = fclose(f) == 0 && ok;
+    free(data);
+    if (!ok)
+    {
+        perror("Failed to write model file");
+    }
+    return ok;
+}
+
+static bool model_section_fits(const BinaryModelHeader *header, uint64_t offset, uint64_t length)
+{
+    return offset % 8 == 0 && offset >= sizeof(BinaryModelHeader) && offset <= header->file_size &&
+           length <= header->file_size - offset;
+}
+
+// Checks everything encoding and decoding rely on, so a damaged or hostile
+// file fails here instead of reading out of bounds later. Returns NULL when
+// the model is usable, otherwise what is wrong with it.
+static const char *check_binary_model(const char *data, size_t size)
+{
+    const BinaryModelHeader *header = (const BinaryModelHeader *)data;
+    if (size < sizeof(BinaryModelHeader) || memcmp(header->magic, BINARY_MODEL_MAGIC, sizeof(header->magic)) != 0)
+        return "not a binary model";
+    if (header->version != BINARY_MODEL_VERSION)
+        return "unsupported version";
+    if (header->byte_order != BINARY_MODEL_BYTE_ORDER)
+        return "written with a different byte order";
+    if (header->header_size != sizeof(BinaryModelHeader) || header->file_size != size || size % 8 != 0)
+        return "truncated or resized";
+    if (header->merge_size > (uint32_t)INT32_MAX - 256 || header->vocab_size < 256 + header->merge_size ||
+        header->vocab_size > (uint32_t)INT32_MAX - 1 || header->special_size > header->vocab_size)
+        return "inconsistent sizes";
+    if (header->merge_slot_count < 2 || (header->merge_slot_count & (header->merge_slot_count - 1)) != 0 ||
+        header->merge_slot_count <= header->merge_size)
+        return "invalid merge slot count";
+    if (!model_section_fits(header, header->merges_offset, (uint64_t)header->merge_size * sizeof(Pair)) ||
+        !model_section_fits(header, header->special_offset, (uint64_t)header->special_size * sizeof(int)) ||
+        !model_section_fits(header, header->special_offsets_offset, ((uint64_t)header->special_size + 1) * sizeof(uint64_t)) ||
+        !model_section_fits(header, header->slots_offset, (uint64_t)header->merge_slot_count * sizeof(int)) ||
+        !model_section_fits(header, header->vocab_offsets_offset, ((uint64_t)header->vocab_size + 1) * sizeof(uint64_t)) ||
+        !model_section_fits(header, header->pattern_offset, (uint64_t)header->pattern_length + 1))
+        return "section out of bounds";
+    if (checksum_model_words(data + sizeof(BinaryModelHeader), size - sizeof(BinaryModelHeader)) != header->checksum)
+        return "checksum mismatch";
+
+    const Pair *merges = (const Pair *)(data + header->merges_offset);
+    for (uint32_t i = 0; i < header->merge_size; ++i)
+    {
+        int idx = 256 + (int)i;
+        if (merges[i].first < 0 || merges[i].first >= idx || merges[i].second < 0 || merges[i].second >= idx)
+            return "invalid merge";
+    }
+    const int *special_tokens = (const int *)(data + header->special_offset);
+    for (uint32_t i = 0; i < header->special_size; ++i)
+    {
+        if (special_tokens[i] < 0 || (uint32_t)special_tokens[i] >= header->vocab_size)
+            return "invalid special token";
+    }
+    const uint64_t *special_offsets = (const uint64_t *)(data + header->special_offsets_offset);
+    if (special_offsets[0] != 0)
+        return "invalid special token offsets";
+    for (uint32_t i = 0; i < header->special_size; ++i)
+    {
+        if (special_offsets[i + 1] < special_offsets[i])
+            return "invalid special token offsets";
+    }
+    if (!model_section_fits(header, header->special_bytes_offset, special_offsets[header->special_size]))
+        return "special token bytes out of bounds";
+    if (header->special_size > 0)
+    {
+        SpecialLiteral *sorted = (SpecialLiteral *)matcher_alloc(header->special_size * sizeof(SpecialLiteral));
+        int *sorted_ids = (int *)matcher_alloc(header->special_size * sizeof(int));
+        const unsigned char *special_bytes = (const unsigned char *)data + header->special_bytes_offset;
+        for (uint32_t i = 0; i < header->special_size; ++i)
+        {
+            sorted[i] = (SpecialLiteral){special_bytes + special_offsets[i], special_offsets[i + 1] - special_offsets[i], (int)i};
+            sorted_ids[i] = special_tokens[i];
+        }
+        const char *error = check_special_tokens(sorted, sorted_ids, (int)header->special_size, 256 + (int)header->merge_size);
+        free(sorted);
+        free(sorted_ids);
+        if (error)
+            return error;
+    }
+    const int *slots = (const int *)(data + header->slots_offset);
+    bool has_empty_slot = false;
+    for (uint32_t i = 0; i < header->merge_slot_count; ++i)
+    {
+        if (slots[i] < -1 || slots[i] >= (int)header->merge_size)
+            return "invalid merge slot";
+        has_empty_slot |= slots[i] == -1;
+    }
+    if (!has_empty_slot)
+        return "merge slot table is full";
+    const uint64_t *offsets = (const uint64_t *)(data + header->vocab_offsets_offset);
+    if (offsets[0] != 0)
+        return "invalid vocab offsets";
+    for (uint32_t i = 0; i < header->vocab_size; ++i)
+    {
+        if (offsets[i + 1] < offsets[i])
+            return "invalid vocab offsets";
+    }
+    if (!model_section_fits(header, header->vocab_bytes_offset, offsets[header->vocab_size]) ||
+        header->vocab_bytes_offset + offsets[header->vocab_size] > header->pattern_offset)
+        return "vocab bytes out of bounds";
+    const char *pattern = data + header->pattern_offset;
+    if (memchr(pattern, '\0', header->pattern_length + 1) != pattern + header->pattern_length)
+        return "invalid pattern";
+    return NULL;
+}
+
+// Maps a model written by save_tokenizer_binary and uses its arrays in place.
+// Only the compiled pattern, the special token matcher and the encode cache
+// are allocated. The tokenizer
+// is read-only: it encodes and decodes but cannot be trained or reloaded.
+bool init_regex_tokenizer_from_binary(RegexTokenizer *tokenizer, const char *model_file, int cache_capacity, bool thread_safe_cache)
+{
+    if (sizeof(size_t) != sizeof(uint64_t))
+    {
+        fprintf(stderr, "Binary models need a 64-bit size_t\n");
+        return false;
+    }
+    int fd = open(model_file, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Failed to open model file");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BinaryModelHeader))
+    {
+        fprintf(stderr, "Invalid binary model %s: truncated or resized\n", model_file);
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror("Failed to map model file");
+        return false;
+    }
+    const char *error = check_binary_model((const char *)mapping, size);
+    if (error != NULL)
+    {
+        fprintf(stderr, "Invalid binary model %s: %s\n", model_file, error);
+        munmap(mapping, size);
+        return false;
+    }
+
+    const BinaryModelHeader *header = (const BinaryModelHeader *)mapping;
+    char *data = (char *)mapping;
+    tokenizer->merges = (Pair *)(data + header->merges_offset);
+    tokenizer->merge_size = header->merge_size;
+    tokenizer->merge_capacity = header->merge_size;
+    tokenizer->merge_slots = (int *)(data + header->slots_offset);
+    tokenizer->merge_slot_mask = header->merge_slot_count - 1;
+    tokenizer->pattern = data + header->pattern_offset;
+    tokenizer->special_tokens = (int *)(data + header->special_offset);
+    tokenizer->special_offsets = (size_t *)(data + header->special_offsets_offset);
+    tokenizer->special_bytes = data + header->special_bytes_offset;
+    tokenizer->special_size = header->special_size;
+    tokenizer->special_capacity = header->special_size;
+    tokenizer->vocab_bytes = data + header->vocab_bytes_offset;
+    tokenizer->vocab_offsets = (size_t *)(data + header->vocab_offsets_offset);
+    tokenizer->vocab_size = header->vocab_size;
+    tokenizer->mapping = mapping;
+    tokenizer->mapping_size = size;
+    memset(&tokenizer->special_matcher, 0, sizeof(SpecialMatcher));
+    build_special_matcher(tokenizer);
+    compile_pattern(tokenizer);
+    create_tokenizer_cache(tokenizer, cache_capacity, thread_safe_cache);
+    create_metrics_recorder(tokenizer);
+    return true;
+}
+
+// Turns metrics recording on or off. Calls already running finish as they
+// began; nothing is lost or reset either way.
+void set_tokenizer_metrics(const RegexTokenizer *tokenizer, bool enabled)
+{
+    if (tokenizer->metrics)
+    {
+        __atomic_store_n(&tokenizer->metrics->enabled, enabled ? 1 : 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Copies the counters into metrics. Each counter is read atomically, though
+// calls finishing meanwhile may show up in some counters and not yet in others.
+void read_tokenizer_metrics(const RegexTokenizer *tokenizer, TokenizerMetrics *metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    if (tokenizer->metrics)
+    {
+        const uint64_t *counters = (const uint64_t *)&tokenizer->metrics->counters;
+        uint64_t *copy = (uint64_t *)metrics;
+        for (size_t i = 0; i < sizeof(*metrics) / sizeof(uint64_t); ++i)
+        {
+            copy[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        }
+    }
+    metrics->process_allocations = __atomic_load_n(&heap_allocations, __ATOMIC_RELAXED);
+}
+
+// Zeroes the tokenizer's counters; the process-wide allocation count is not
+// the tokenizer's to reset, so compare two reads of it instead
+void reset_tokenizer_metrics(const RegexTokenizer *tokenizer)
+{
+    if (tokenizer->metrics)
+    {
+        uint64_t *counters = (uint64_t *)&tokenizer->metrics->counters;
+        for (size_t i = 0; i < sizeof(TokenizerMetrics) / sizeof(uint64_t); ++i)
+        {
+            __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+typedef struct
+{
+    char *output;
+    size_t size;
+    size_t length; // of the whole text, even past size
+} MetricsWriter;
+
+static void write_metrics(MetricsWriter *writer, const char *format, ...)
+{
+    size_t room = writer->length < writer->size ? writer->size - writer->length : 0;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(room > 0 ? writer->output + writer->length : NULL, room, format, args);
+    va_end(args);
+    if (written > 0)
+    {
+        writer->length += written;
+    }
+}
+
+// Cumulative latency buckets, as in a Prometheus histogram
+static void write_json_latency(MetricsWriter *writer, uint64_t calls, const uint64_t *latency)
+{
+    write_metrics(writer, "\"latency\":[");
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= METRICS_LATENCY_BUCKETS; ++i)
+    {
+        cumulative += latency[i];
+        if (i < METRICS_LATENCY_BUCKETS)
+        {
+            write_metrics(writer, "{\"le\":%g,\"count\":%llu},", (double)(1ull << i) * 1e-6, (unsigned long long)cumulative);
+        }
+        else
+        {
+            write_metrics(writer, "{\"le\":\"+Inf\",\"count\":%llu}]", (unsigned long long)calls);
+        }
+    }
+}
+
+static void write_json_metrics(MetricsWriter *writer, const TokenizerMetrics *metrics, const char *name)
+{
+    write_metrics(writer, "{");
+    if (name)
+    {
+        write_metrics(writer, "\"tokenizer\":\"%s\",", name);
+    }
+    write_metrics(writer,
+                  "\"encode\":{\"calls\":%llu,\"bytes\":%llu,\"tokens\":%llu,\"chunks\":%llu,\"cache_hits\":%llu,"
+                  "\"cache_misses\":%llu,\"seconds\":%.9f,\"split_seconds\":%.9f,\"merge_seconds\":%.9f,",
+                  (unsigned long long)metrics->encode_calls, (unsigned long long)metrics->encode_bytes,
+                  (unsigned long long)metrics->encode_tokens, (unsigned long long)metrics->chunks,
+                  (unsigned long long)metrics->cache_hits, (unsigned long long)metrics->cache_misses, metrics->encode_ns * 1e-9,
+                  (metrics->encode_ns > metrics->merge_ns ? metrics->encode_ns - metrics->merge_ns : 0) * 1e-9,
+                  metrics->merge_ns * 1e-9);
+    write_json_latency(writer, metrics->encode_calls, metrics->encode_latency);
+    write_metrics(writer, "},\"decode\":{\"calls\":%llu,\"tokens\":%llu,\"bytes\":%llu,\"seconds\":%.9f,",
+                  (unsigned long long)metrics->decode_calls, (unsigned long long)metrics->decode_tokens,
+                  (unsigned long long)metrics->decode_bytes, metrics->decode_ns * 1e-9);
+    write_json_latency(writer, metrics->decode_calls, metrics->decode_latency);
+    write_metrics(writer, "},\"process_allocations\":%llu}\n", (unsigned long long)metrics->process_allocations);
+}
+
+static void write_prometheus_counter(MetricsWriter *writer, const char *metric, const char *name, uint64_t value)
+{
+    write_metrics(writer, "# TYPE tokenizer_%s_total counter\n", metric);
+    if (name)
+    {
+        write_metrics(writer, "tokenizer_%s_total{tokenizer=\"%s\"} %llu\n", metric, name, (unsigned long long)value);
+    }
+    else
+    {
+        write_metrics(writer, "tokenizer_%s_total %llu\n", metric, (unsigned long long)value);
+    }
+}
+
+static void write_prometheus_histogram(MetricsWriter *writer, const char *metric, const char *name, const uint64_t *latency,
+                                       uint64_t calls, uint64_t nanoseconds)
+{
+    const char *label = name ? "tokenizer=\"" : "";
+    const char *label_end = name ? "\"," : "";
+    const char *label_name = name ? name : "";
+    write_metrics(writer, "# TYPE tokenizer_%s_seconds histogram\n", metric);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; ++i)
+    {
+        cumulative += latency[i];
+        write_metrics(writer, "tokenizer_%s_seconds_bucket{%s%s%sle=\"%g\"} %llu\n", metric, label, label_name, label_end,
+                      (double)(1ull << i) * 1e-6, (unsigned long long)cumulative);
+    }
+    write_metrics(writer, "tokenizer_%s_seconds_bucket{%s%s%sle=\"+Inf\"} %llu\n", metric, label, label_name, label_end,
+                  (unsigned long long)calls);
+    if (name)
+    {
+        write_metrics(writer, "tokenizer_%s_seconds_sum{tokenizer=\"%s\"} %.9f\n", metric, name, nanoseconds * 1e-9);
+        write_metrics(writer, "tokenizer_%s_seconds_count{tokenizer=\"%s\"} %llu\n", metric, name, (unsigned long long)calls);
+    }
+    else
+    {
+        write_metrics(writer, "tokenizer_%s_seconds_sum %.9f\n", metric, nanoseconds * 1e-9);
+        write_metrics(writer, "tokenizer_%s_seconds_count %llu\n", metric, (unsigned long long)calls);
+    }
+}
+
+static void write_prometheus_metrics(MetricsWriter *writer, const TokenizerMetrics *metrics, const char *name)
+{
+    write_prometheus_counter(writer, "encode_calls", name, metrics->encode_calls);
+    write_prometheus_counter(writer, "encode_bytes", name, metrics->encode_bytes);
+    write_prometheus_counter(writer, "encode_tokens", name, metrics->encode_tokens);
+    write_prometheus_counter(writer, "encode_chunks", name, metrics->chunks);
+    write_prometheus_counter(writer, "encode_cache_hits", name, metrics->cache_hits);
+    write_prometheus_counter(writer, "encode_cache_misses", name, metrics->cache_misses);
+    write_metrics(writer, "# TYPE tokenizer_encode_merge_seconds_total counter\n");
+    if (name)
+    {
+        write_metrics(writer, "tokenizer_encode_merge_seconds_total{tokenizer=\"%s\"} %.9f\n", name, metrics->merge_ns * 1e-9);
+    }
+    else
+    {
+        write_metrics(writer, "tokenizer_encode_merge_seconds_total %.9f\n", metrics->merge_ns * 1e-9);
+    }
+    write_prometheus_histogram(writer, "encode", name, metrics->encode_latency, metrics->encode_calls, metrics->encode_ns);
+    write_prometheus_counter(writer, "decode_tokens", name, metrics->decode_tokens);
+    write_prometheus_counter(writer, "decode_bytes", name, metrics->decode_bytes);
+    write_prometheus_histogram(writer, "decode", name, metrics->decode_latency, metrics->decode_calls, metrics->decode_ns);
+    // Not labelled with the tokenizer, whose name it would wrongly suggest it counts
+    write_prometheus_counter(writer, "process_allocations", NULL, metrics->process_allocations);
+}
+
+// Writes metrics as JSON or Prometheus text exposition into output, like
+// snprintf: at most size bytes, terminated when size > 0, and returns the
+// length of the whole text so a too-small output can be retried. name, if
+// not NULL, labels the tokenizer and is written as is, so it must not need
+// escaping.
+size_t format_tokenizer_metrics(const TokenizerMetrics *metrics, MetricsFormat format, const char *name, char *output, size_t size)
+{
+    MetricsWriter writer = {output, size, 0};
+    if (format == METRICS_FORMAT_PROMETHEUS)
+    {
+        write_prometheus_metrics(&writer, metrics, name);
+    }
+    else
+    {
+        write_json_metrics(&writer, metrics, name);
+    }
+    return writer.length;
+}
+
+// Moves tokenizer, which must be done training and loading, into frozen and
+// leaves it empty: free_regex_tokenizer on it does nothing. The tokenizer's
+// cache is dropped, since every thread sharing it would contend for it; give
+// each thread's EncodeContext a cache of its own instead.
+void freeze_regex_tokenizer(FrozenTokenizer *frozen, RegexTokenizer *tokenizer)
+{
+    frozen->tokenizer = *tokenizer;
+    memset(tokenizer, 0, sizeof(RegexTokenizer));
+    RegexTokenizer *t = &frozen->tokenizer;
+    if (t->cache)
+    {
+        free_encode_cache(t->cache);
+        free(t->cache);
+        t->cache = NULL;
+    }
+    // Trim the slack kept for training, which can no longer add merges
+    if (!t->mapping && t->merge_size > 0 && t->merge_size < t->merge_capacity)
+    {
+        Pair *merges = (Pair *)counted_realloc(t->merges, t->merge_size * sizeof(Pair));
+        if (merges != NULL)
+        {
+            t->merges = merges;
+            t->merge_capacity = t->merge_size;
+        }
+    }
+}
+
+// The only view of a frozen tokenizer, for the functions that read a tokenizer
+const RegexTokenizer *frozen_tokenizer(const FrozenTokenizer *frozen)
+{
+    return &frozen->tokenizer;
+}
+
+void free_frozen_tokenizer(FrozenTokenizer *frozen)
+{
+    free_regex_tokenizer(&frozen->tokenizer);
+    memset(&frozen->tokenizer, 0, sizeof(RegexTokenizer));
+}
+
+static void init_bpe_scratch(BpeScratch *scratch, Arena *arena)
+{
+    scratch->metrics = NULL;
+    scratch->ids = NULL;
+    scratch->prev = NULL;
+    scratch->next = NULL;
+    scratch->heap = NULL;
+    scratch->heap_size = 0;
+    scratch->capacity = 0;
+    scratch->arena = arena;
+}
+
+static void free_bpe_scratch(BpeScratch *scratch)
+{
+    container_free(scratch->arena, scratch->ids);
+    container_free(scratch->arena, scratch->prev);
+    container_free(scratch->arena, scratch->next);
+    container_free(scratch->arena, scratch->heap);
+    struct MetricsSample *metrics = scratch->metrics; // reserve_bpe_scratch frees mid-call
+    init_bpe_scratch(scratch, scratch->arena);
+    scratch->metrics = metrics;
+}
+
+static void reserve_bpe_scratch(BpeScratch *scratch, int length)
+{
+    if (length <= scratch->capacity)
+    {
+        return;
+    }
+    int capacity = scratch->capacity ? scratch->capacity : 64;
+    while (capacity < length)
+    {
+        capacity *= 2;
+    }
+    free_bpe_scratch(scratch);
+    scratch->ids = (int *)container_alloc(scratch->arena, capacity * sizeof(int));
+    scratch->prev = (int *)container_alloc(scratch->arena, capacity * sizeof(int));
+    scratch->next = (int *)container_alloc(scratch->arena, capacity * sizeof(int));
+    // Every merge pushes at most two entries on top of the initial pairs
+    scratch->heap = (uint64_t *)container_alloc(scratch->arena, 3 * capacity * sizeof(uint64_t));
+    scratch->capacity = capacity;
+}
+
+// Heap entries pack (rank, position) so that the smallest value is the
+// lowest-ranked merge and, among equal ranks, the leftmost occurrence
+static void bpe_heap_push(BpeScratch *scratch, int rank, int pos)
+{
+    uint64_t entry = ((uint64_t)rank << 32) | (uint32_t)pos;
+    int i = scratch->heap_size++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (scratch->heap[parent] <= entry)
+        {
+            break;
+        }
+        scratch->heap[i] = scratch->heap[parent];
+        i = parent;
+    }
+    scratch->heap[i] = entry;
+}
+
+static uint64_t bpe_heap_pop(BpeScratch *scratch)
+{
+    uint64_t top = scratch->heap[0];
+    uint64_t last = scratch->heap[--scratch->heap_size];
+    int i = 0;
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= scratch->heap_size)
+        {
+            break;
+        }
+        if (child + 1 < scratch->heap_size && scratch->heap[child + 1] < scratch->heap[child])
+        {
+            child++;
+        }
+        if (scratch->heap[child] >= last)
+        {
+            break;
+        }
+        scratch->heap[i] = scratch->heap[child];
+        i = child;
+    }
+    if (scratch->heap_size > 0)
+    {
+        scratch->heap[i] = last;
+    }
+    return top;
+}
+
+// Applies merges in rank order inside one chunk, in scratch. Same result as
+// repeatedly merging the lowest-ranked pair present: a merge only creates
+// pairs of higher rank, so every occurrence of one rank is consumed left to
+// right before the next rank is considered. Each token ends up at the position
+// of its first byte, linked through next from position 0; the other positions
+// hold -1.
+static void apply_merge_ranks(const RegexTokenizer *tokenizer, const unsigned char *bytes, int length, BpeScratch *scratch)
+{
+    reserve_bpe_scratch(scratch, length);
+    int *ids = scratch->ids;
+    int *prev = scratch->prev;
+    int *next = scratch->next;
+    scratch->heap_size = 0;
+    for (int i = 0; i < length; ++i)
+    {
+        ids[i] = bytes[i];
+        prev[i] = i - 1;
+        next[i] = i + 1 < length ? i + 1 : -1;
+    }
+    for (int i = 0; i + 1 < length; ++i)
+    {
+        int rank = find_merge_rank(tokenizer, (Pair){ids[i], ids[i + 1]});
+        if (rank >= 0)
+        {
+            bpe_heap_push(scratch, rank, i);
+        }
+    }
+
+    while (scratch->heap_size > 0)
+    {
+        uint64_t entry = bpe_heap_pop(scratch);
+        int rank = (int)(entry >> 32);
+        int pos = (int)(uint32_t)entry;
+        int right = next[pos];
+        // Skip entries whose pair was consumed or changed by an earlier merge
+        if (ids[pos] < 0 || right < 0 || find_merge_rank(tokenizer, (Pair){ids[pos], ids[right]}) != rank)
+        {
+            continue;
+        }
+        ids[pos] = 256 + rank;
+        ids[right] = -1;
+        next[pos] = next[right];
+        if (next[pos] >= 0)
+        {
+            prev[next[pos]] = pos;
+        }
+        if (prev[pos] >= 0)
+        {
+            int left_rank = find_merge_rank(tokenizer, (Pair){ids[prev[pos]], ids[pos]});
+            if (left_rank >= 0)
+            {
+                bpe_heap_push(scratch, left_rank, prev[pos]);
+            }
+        }
+        if (next[pos] >= 0)
+        {
+            int right_rank = find_merge_rank(tokenizer, (Pair){ids[pos], ids[next[pos]]});
+            if (right_rank >= 0)
+            {
+                bpe_heap_push(scratch, right_rank, pos);
+            }
+        }
+    }
+}
+
+// Appends the ids of one chunk, merged by apply_merge_ranks
+static void encode_chunk(const RegexTokenizer *tokenizer, const unsigned char *bytes, int length, BpeScratch *scratch, IntArray *result)
+{
+    if (length == 1)
+    {
+        append_int_array(result, bytes[0]);
+        return;
+    }
+    apply_merge_ranks(tokenizer, bytes, length, scratch);
+    for (int i = 0; i >= 0; i = scratch->next[i])
+    {
+        append_int_array(result, scratch->ids[i]);
+    }
+}
+
+// Incremental BPE training state. Every unique chunk is laid out as a run of
+// nodes in a doubly linked list, in order of first appearance, and carries
+// its frequency as a weight; pairs never span two chunks. Comparing node
+// positions therefore compares the first occurrences in the original chunk
+// stream. For every pair we keep its exact weighted count, the positions
+// where it occurs (possibly stale, validated lazily) and a lower bound on its
+// first position. A lazy max-heap orders pairs by (count desc, first position
+// asc), which is the same winner the get_stats/argmax loop picks, ties included.
+typedef struct
+{
+    int id; // -1 once merged into the left neighbour
+    int prev;
+    int next;
+    int chunk;
+} TrainNode;
+
+typedef struct
+{
+    long long count;
+    int first_pos;
+    int dirty_step;
+    IntArray positions;
+} TrainPairStats;
+
+typedef struct
+{
+    long long count;
+    int first_pos;
+    int pair;
+} TrainHeapEntry;
+
+typedef struct
+{
+    TrainNode *nodes;
+    int num_nodes;
+    const long long *weights;
+    PairCountTable index;
+    TrainPairStats *pairs;
+    int pairs_capacity;
+    TrainHeapEntry *heap;
+    int heap_size;
+    int heap_capacity;
+    IntArray touched;
+} TrainState;
+
+// Returns the index of pair in table, inserting it with a zero count if absent
+static int intern_pair(PairCountTable *table, Pair pair)
+{
+    int index = find_pair_index(table, pair);
+    if (index < 0)
+    {
+        add_or_update_pair_count(table, pair);
+        index = table->size - 1;
+        table->counts[index] = 0;
+    }
+    return index;
+}
+
+static int heap_entry_before(const TrainHeapEntry *a, const TrainHeapEntry *b)
+{
+    return a->count > b->count || (a->count == b->count && a->first_pos < b->first_pos);
+}
+
+static void train_heap_push(TrainState *state, int pair)
+{
+    if (state->heap_size == state->heap_capacity)
+    {
+        state->heap_capacity = state->heap_capacity ? state->heap_capacity * 2 : 256;
+        TrainHeapEntry *new_heap = (TrainHeapEntry *)counted_realloc(state->heap, state->heap_capacity * sizeof(TrainHeapEntry));
+        if (new_heap == NULL)
+        {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        state->heap = new_heap;
+    }
+    TrainHeapEntry entry = {state->pairs[pair].count, state->pairs[pair].first_pos, pair};
+    int i = state->heap_size++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (!heap_entry_before(&entry, &state->heap[parent]))
+        {
+            break;
+        }
+        state->heap[i] = state->heap[parent];
+        i = parent;
+    }
+    state->heap[i] = entry;
+}
+
+static TrainHeapEntry train_heap_pop(TrainState *state)
+{
+    TrainHeapEntry top = state->heap[0];
+    TrainHeapEntry last = state->heap[--state->heap_size];
+    int i = 0;
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= state->heap_size)
+        {
+            break;
+        }
+        if (child + 1 < state->heap_size && heap_entry_before(&state->heap[child + 1], &state->heap[child]))
+        {
+            child++;
+        }
+        if (!heap_entry_before(&state->heap[child], &last))
+        {
+            break;
+        }
+        state->heap[i] = state->heap[child];
+        i = child;
+    }
+    if (state->heap_size > 0)
+    {
+        state->heap[i] = last;
+    }
+    return top;
+}
+
+static int train_pair_index(TrainState *state, Pair pair)
+{
+    int index = intern_pair(&state->index, pair);
+    if (index >= state->pairs_capacity)
+    {
+        int old_capacity = state->pairs_capacity;
+        state->pairs_capacity = state->index.capacity;
+        TrainPairStats *new_pairs = (TrainPairStats *)counted_realloc(state->pairs, state->pairs_capacity * sizeof(TrainPairStats));
+        if (new_pairs == NULL)
+        {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        state->pairs = new_pairs;
+        memset(state->pairs + old_capacity, 0, (state->pairs_capacity - old_capacity) * sizeof(TrainPairStats));
+    }
+    TrainPairStats *stats = &state->pairs[index];
+    if (stats->positions.ids == NULL)
+    {
+        init_int_array(&stats->positions, 4);
+        stats->first_pos = state->num_nodes;
+        stats->dirty_step = -1;
+    }
+    return index;
+}
+
+static void add_pair_occurrence(TrainState *state, Pair pair, int pos, int step)
+{
+    int index = train_pair_index(state, pair);
+    TrainPairStats *stats = &state->pairs[index];
+    stats->count += state->weights[state->nodes[pos].chunk];
+    append_int_array(&stats->positions, pos);
+    if (pos < stats->first_pos)
+    {
+        stats->first_pos = pos;
+    }
+    // Heap entries are pushed once per step for every pair whose count grew
+    if (stats->dirty_step != step)
+    {
+        stats->dirty_step = step;
+        append_int_array(&state->touched, index);
+    }
+}
+
+static void remove_pair_occurrence(TrainState *state, Pair pair, long long weight)
+{
+    // The stale position stays in the list and is dropped on the next refresh
+    state->pairs[find_pair_index(&state->index, pair)].count -= weight;
+}
+
+static void flush_touched_pairs(TrainState *state)
+{
+    for (int i = 0; i < state->touched.size; ++i)
+    {
+        train_heap_push(state, state->touched.ids[i]);
+    }
+    state->touched.size = 0;
+}
+
+static int pair_occurs_at(const TrainState *state, Pair pair, int pos)
+{
+    const TrainNode *node = &state->nodes[pos];
+    return node->id == pair.first && node->next >= 0 && state->nodes[node->next].id == pair.second;
+}
+
+// Drops stale positions and returns the exact first position of the pair
+static int refresh_pair_positions(TrainState *state, int index)
+{
+    TrainPairStats *stats = &state->pairs[index];
+    Pair pair = state->index.pairs[index];
+    int first_pos = state->num_nodes;
+    int kept = 0;
+    for (int i = 0; i < stats->positions.size; ++i)
+    {
+        int pos = stats->positions.ids[i];
+        if (pair_occurs_at(state, pair, pos))
+        {
+            stats->positions.ids[kept++] = pos;
+            if (pos < first_pos)
+            {
+                first_pos = pos;
+            }
+        }
+    }
+    stats->positions.size = kept;
+    stats->first_pos = first_pos;
+    return first_pos;
+}
+
+// Pops heap entries until one carries the exact current key of its pair
+static int pop_best_pair(TrainState *state)
+{
+    while (state->heap_size > 0)
+    {
+        TrainHeapEntry entry = train_heap_pop(state);
+        TrainPairStats *stats = &state->pairs[entry.pair];
+        if (stats->count <= 0)
+        {
+            continue;
+        }
+        if (entry.count > stats->count)
+        {
+            // Count dropped since this entry was pushed; requeue the current key
+            train_heap_push(state, entry.pair);
+            continue;
+        }
+        if (entry.count < stats->count || entry.first_pos != stats->first_pos)
+        {
+            // A fresher entry for this pair is already queued
+            continue;
+        }
+        if (refresh_pair_positions(state, entry.pair) != entry.first_pos)
+        {
+            train_heap_push(state, entry.pair);
+            continue;
+        }
+        return entry.pair;
+    }
+    return -1;
+}
+
+// Replaces every occurrence of the pair, left to right, and updates only the
+// counts of the neighbouring pairs that changed
+static void apply_train_merge(TrainState *state, int index, int idx, int step)
+{
+    Pair pair = state->index.pairs[index];
+    IntArray positions = state->pairs[index].positions;
+    state->pairs[index].positions.ids = NULL;
+    state->pairs[index].positions.size = 0;
+    state->pairs[index].positions.capacity = 0;
+    qsort(positions.ids, positions.size, sizeof(int), compare_ints);
+
+    for (int i = 0; i < positions.size; ++i)
+    {
+        int pos = positions.ids[i];
+        if (!pair_occurs_at(state, pair, pos))
+        {
+            continue; // Overlapping occurrence consumed by the previous merge
+        }
+        TrainNode *nodes = state->nodes;
+        long long weight = state->weights[nodes[pos].chunk];
+        int right = nodes[pos].next;
+        int prev = nodes[pos].prev;
+        int next = nodes[right].next;
+        if (prev >= 0)
+        {
+            remove_pair_occurrence(state, (Pair){nodes[prev].id, pair.first}, weight);
+        }
+        if (next >= 0)
+        {
+            remove_pair_occurrence(state, (Pair){pair.second, nodes[next].id}, weight);
+        }
+        state->pairs[index].count -= weight;
+
+        nodes[pos].id = idx;
+        nodes[pos].next = next;
+        if (next >= 0)
+        {
+            nodes[next].prev = pos;
+        }
+        nodes[right].id = -1;
+
+        if (prev >= 0)
+        {
+            add_pair_occurrence(state, (Pair){nodes[prev].id, idx}, prev, step);
+        }
+        if (next >= 0)
+        {
+            add_pair_occurrence(state, (Pair){idx, nodes[next].id}, pos, step);
+        }
+    }
+    free_int_array(&positions);
+    flush_touched_pairs(state);
+}
+
+// Pair deltas collected by one merge worker, reduced serially afterwards
+typedef struct
+{
+    PairCountTable index;
+    long long *weights;
+    IntArray *positions;
+    int capacity;
+} PairDeltaTable;
+
+static void init_pair_delta_table(PairDeltaTable *table)
+{
+    init_pair_count_table(&table->index, 64);
+    table->weights = NULL;
+    table->positions = NULL;
+    table->capacity = 0;
+}
+
+static void free_pair_delta_table(PairDeltaTable *table)
+{
+    for (int i = 0; i < table->index.size; ++i)
+    {
+        if (table->positions[i].ids)
+        {
+            free_int_array(&table->positions[i]);
+        }
+    }
+    free(table->weights);
+    free(table->positions);
+    free_pair_count_table(&table->index);
+}
+
+static int pair_delta_index(PairDeltaTable *table, Pair pair)
+{
+    int index = intern_pair(&table->index, pair);
+    if (index >= table->capacity)
+    {
+        int old_capacity = table->capacity;
+        table->capacity = table->index.capacity;
+        long long *new_weights = (long long *)counted_realloc(table->weights, table->capacity * sizeof(long long));
+        IntArray *new_positions = (IntArray *)counted_realloc(table->positions, table->capacity * sizeof(IntArray));
+        if (new_weights == NULL || new_positions == NULL)
+        {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        table->weights = new_weights;
+        table->positions = new_positions;
+        memset(table->weights + old_capacity, 0, (table->capacity - old_capacity) * sizeof(long long));
+        memset(table->positions + old_capacity, 0, (table->capacity - old_capacity) * sizeof(IntArray));
+    }
+    return index;
+}
+
+typedef struct
+{
+    struct MergePool *pool;
+    TrainState *state;
+    Pair pair;
+    int idx;
+    const int *positions;
+    int num_positions;
+    long long merged_weight;
+    PairDeltaTable removed;
+    PairDeltaTable added;
+} MergeShard;
+
+// Shard workers kept for a whole training run, so that large merges do not
+// pay for creating threads. The training thread runs shard 0 itself. One
+// merge runs at a time per pool.
+typedef struct MergePool
+{
+    int num_threads;
+    pthread_t *threads;
+    MergeShard *shards;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    long long generation; // bumped for every merge
+    int running;          // pool threads still working on the current merge
+    bool shutdown;
+} MergePool;
+
+// Same rewrite as apply_train_merge over a run of whole chunks. Nodes are only
+// touched inside those chunks; count changes are collected for the reduce.
+static void *apply_merge_shard(void *arg)
+{
+    MergeShard *shard = (MergeShard *)arg;
+    TrainState *state = shard->state;
+    TrainNode *nodes = state->nodes;
+    Pair pair = shard->pair;
+    int idx = shard->idx;
+    for (int i = 0; i < shard->num_positions; ++i)
+    {
+        int pos = shard->positions[i];
+        if (!pair_occurs_at(state, pair, pos))
+        {
+            continue;
+        }
+        long long weight = state->weights[nodes[pos].chunk];
+        int right = nodes[pos].next;
+        int prev = nodes[pos].prev;
+        int next = nodes[right].next;
+        if (prev >= 0)
+        {
+            int index = pair_delta_index(&shard->removed, (Pair){nodes[prev].id, pair.first});
+            shard->removed.weights[index] += weight;
+        }
+        if (next >= 0)
+        {
+            int index = pair_delta_index(&shard->removed, (Pair){pair.second, nodes[next].id});
+            shard->removed.weights[index] += weight;
+        }
+        shard->merged_weight += weight;
+
+        nodes[pos].id = idx;
+        nodes[pos].next = next;
+        if (next >= 0)
+        {
+            nodes[next].prev = pos;
+        }
+        nodes[right].id = -1;
+
+        if (prev >= 0)
+        {
+            int index = pair_delta_index(&shard->added, (Pair){nodes[prev].id, idx});
+            shard->added.weights[index] += weight;
+            if (shard->added.positions[index].ids == NULL)
+            {
+                init_int_array(&shard->added.positions[index], 4);
+            }
+            append_int_array(&shard->added.positions[index], prev);
+        }
+        if (next >= 0)
+        {
+            int index = pair_delta_index(&shard->added, (Pair){idx, nodes[next].id});
+            shard->added.weights[index] += weight;
+            if (shard->added.positions[index].ids == NULL)
+            {
+                init_int_array(&shard->added.positions[index], 4);
+            }
+            append_int_array(&shard->added.positions[index], pos);
+        }
+    }
+    return NULL;
+}
+
+static void *merge_pool_main(void *arg)
+{
+    MergeShard *shard = (MergeShard *)arg;
+    MergePool *pool = shard->pool;
+    long long seen = 0;
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        apply_merge_shard(shard);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void init_merge_pool(MergePool *pool, int num_threads)
+{
+    pool->num_threads = num_threads;
+    pool->generation = 0;
+    pool->running = 0;
+    pool->shutdown = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->shards = (MergeShard *)counted_calloc(num_threads, sizeof(MergeShard));
+    pool->threads = (pthread_t *)counted_malloc(num_threads * sizeof(pthread_t));
+    if (pool->shards == NULL || pool->threads == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int t = 0; t < num_threads; ++t)
+    {
+        pool->shards[t].pool = pool;
+    }
+    for (int t = 1; t < num_threads; ++t)
+    {
+        if (pthread_create(&pool->threads[t], NULL, merge_pool_main, &pool->shards[t]) != 0)
+        {
+            fprintf(stderr, "Failed to create training thread\n");
+            exit(1);
+        }
+    }
+}
+
+static void free_merge_pool(MergePool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 1; t < pool->num_threads; ++t)
+    {
+        pthread_join(pool->threads[t], NULL);
+    }
+    free(pool->shards);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+}
+
+// Splits the sorted positions into runs of whole chunks, rewrites them in
+// parallel on the pool and folds the per-shard count changes back in shard
+// order
+static void apply_train_merge_parallel(TrainState *state, int index, int idx, int step, MergePool *pool)
+{
+    Pair pair = state->index.pairs[index];
+    IntArray positions = state->pairs[index].positions;
+    state->pairs[index].positions.ids = NULL;
+    state->pairs[index].positions.size = 0;
+    state->pairs[index].positions.capacity = 0;
+    qsort(positions.ids, positions.size, sizeof(int), compare_ints);
+
+    int num_threads = pool->num_threads;
+    MergeShard *shards = pool->shards;
+    int begin = 0;
+    for (int t = 0; t < num_threads; ++t)
+    {
+        int split = t + 1 == num_threads ? positions.size : (int)((long long)positions.size * (t + 1) / num_threads);
+        if (split < begin)
+        {
+            split = begin;
+        }
+        while (split > 0 && split < positions.size &&
+               state->nodes[positions.ids[split]].chunk == state->nodes[positions.ids[split - 1]].chunk)
+        {
+            split++;
+        }
+        shards[t].state = state;
+        shards[t].pair = pair;
+        shards[t].idx = idx;
+        shards[t].positions = positions.ids + begin;
+        shards[t].num_positions = split - begin;
+        shards[t].merged_weight = 0;
+        init_pair_delta_table(&shards[t].removed);
+        init_pair_delta_table(&shards[t].added);
+        begin = split;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = num_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    apply_merge_shard(&shards[0]);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int t = 0; t < num_threads; ++t)
+    {
+        MergeShard *shard = &shards[t];
+        state->pairs[index].count -= shard->merged_weight;
+        for (int i = 0; i < shard->added.index.size; ++i)
+        {
+            int global = train_pair_index(state, shard->added.index.pairs[i]);
+            TrainPairStats *stats = &state->pairs[global];
+            const IntArray *added = &shard->added.positions[i];
+            stats->count += shard->added.weights[i];
+            for (int j = 0; j < added->size; ++j)
+            {
+                append_int_array(&stats->positions, added->ids[j]);
+                if (added->ids[j] < stats->first_pos)
+                {
+                    stats->first_pos = added->ids[j];
+                }
+            }
+            if (stats->dirty_step != step)
+            {
+                stats->dirty_step = step;
+                append_int_array(&state->touched, global);
+            }
+        }
+        // After the additions: a later occurrence may remove a pair an earlier one created
+        for (int i = 0; i < shard->removed.index.size; ++i)
+        {
+            remove_pair_occurrence(state, shard->removed.index.pairs[i], shard->removed.weights[i]);
+        }
+        free_pair_delta_table(&shard->removed);
+        free_pair_delta_table(&shard->added);
+    }
+    free_int_array(&positions);
+    flush_touched_pairs(state);
+}
+
+// Lays out the chunks with the tokenizer's merges already applied, exactly as
+// learning those merges on these chunks would have left them
+static void init_train_state(TrainState *state, const ChunkCountTable *chunks, const RegexTokenizer *tokenizer)
+{
+    state->num_nodes = (int)chunks->bytes_size;
+    state->nodes = (TrainNode *)counted_malloc((state->num_nodes > 0 ? state->num_nodes : 1) * sizeof(TrainNode));
+    if (state->nodes == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    state->weights = chunks->counts;
+    BpeScratch scratch;
+    init_bpe_scratch(&scratch, NULL);
+    int pos = 0;
+    for (int c = 0; c < chunks->size; ++c)
+    {
+        const char *bytes = chunks->bytes + chunks->chunks[c].offset;
+        int length = chunks->chunks[c].length;
+        if (tokenizer->merge_size > 0 && length > 1)
+        {
+            apply_merge_ranks(tokenizer, (const unsigned char *)bytes, length, &scratch);
+            for (int j = 0; j < length; ++j, ++pos)
+            {
+                bool alive = scratch.ids[j] >= 0;
+                state->nodes[pos].id = scratch.ids[j];
+                state->nodes[pos].prev = alive && scratch.prev[j] >= 0 ? pos - j + scratch.prev[j] : -1;
+                state->nodes[pos].next = alive && scratch.next[j] >= 0 ? pos - j + scratch.next[j] : -1;
+                state->nodes[pos].chunk = c;
+            }
+            continue;
+        }
+        for (int j = 0; j < length; ++j, ++pos)
+        {
+            state->nodes[pos].id = (int)(unsigned char)bytes[j];
+            state->nodes[pos].prev = j > 0 ? pos - 1 : -1;
+            state->nodes[pos].next = j + 1 < length ? pos + 1 : -1;
+            state->nodes[pos].chunk = c;
+        }
+    }
+    free_bpe_scratch(&scratch);
+    init_pair_count_table(&state->index, 256);
+    state->pairs = NULL;
+    state->pairs_capacity = 0;
+    state->heap = NULL;
+    state->heap_size = 0;
+    state->heap_capacity = 0;
+    init_int_array(&state->touched, 256);
+
+    // Count the number of times every consecutive pair appears, weighted by chunk frequency
+    for (int i = 0; i < state->num_nodes; ++i)
+    {
+        int next = state->nodes[i].next;
+        if (next >= 0)
+        {
+            add_pair_occurrence(state, (Pair){state->nodes[i].id, state->nodes[next].id}, i, 0);
+        }
+    }
+    flush_touched_pairs(state);
+}
+
+static void free_train_state(TrainState *state)
+{
+    for (int i = 0; i < state->index.size; ++i)
+    {
+        if (state->pairs[i].positions.ids)
+        {
+            free_int_array(&state->pairs[i].positions);
+        }
+    }
+    free(state->pairs);
+    free(state->heap);
+    free(state->nodes);
+    free_pair_count_table(&state->index);
+    free_int_array(&state->touched);
+}
+
+static void append_merge(RegexTokenizer *tokenizer, Pair pair)
+{
+    if (tokenizer->merge_size == tokenizer->merge_capacity)
+    {
+        tokenizer->merge_capacity *= 2;
+        Pair *new_merges = (Pair *)counted_realloc(tokenizer->merges, tokenizer->merge_capacity * sizeof(Pair));
+        if (new_merges == NULL)
+        {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        tokenizer->merges = new_merges;
+    }
+    tokenizer->merges[tokenizer->merge_size++] = pair;
+}
+
+// Length of the longest prefix that does not end inside a UTF-8 sequence
+static size_t complete_utf8_prefix(const char *bytes, size_t length)
+{
+    size_t i = length;
+    int continuation = 0;
+    while (i > 0 && continuation < 3 && ((unsigned char)bytes[i - 1] & 0xC0) == 0x80)
+    {
+        i--;
+        continuation++;
+    }
+    if (i == 0)
+    {
+        return length;
+    }
+    unsigned char lead = (unsigned char)bytes[i - 1];
+    int needed = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+    return needed > continuation ? i - 1 : length;
+}
+
+// Same acceptance rules as PCRE's UTF-8 check: no overlong forms, surrogates
+// or code points above U+10FFFF
+static bool is_valid_utf8(const unsigned char *bytes, size_t length)
+{
+    size_t i = 0;
+    while (i < length)
+    {
+        unsigned char c = bytes[i];
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+        int extra;
+        uint32_t code_point;
+        if (c >= 0xC2 && c <= 0xDF)
+        {
+            extra = 1;
+            code_point = c & 0x1F;
+        }
+        else if (c >= 0xE0 && c <= 0xEF)
+        {
+            extra = 2;
+            code_point = c & 0x0F;
+        }
+        else if (c >= 0xF0 && c <= 0xF4)
+        {
+            extra = 3;
+            code_point = c & 0x07;
+        }
+        else
+        {
+            return false;
+        }
+        if (length - i <= (size_t)extra)
+        {
+            return false;
+        }
+        for (int j = 1; j <= extra; ++j)
+        {
+            if ((bytes[i + j] & 0xC0) != 0x80)
+            {
+                return false;
+            }
+            code_point = (code_point << 6) | (bytes[i + j] & 0x3F);
+        }
+        if ((extra == 2 && (code_point < 0x800 || (code_point >= 0xD800 && code_point <= 0xDFFF))) ||
+            (extra == 3 && (code_point < 0x10000 || code_point > 0x10FFFF)))
+        {
+            return false;
+        }
+        i += extra + 1;
+    }
+    return true;
+}
+
+// Hand-written splitter for GPT2_SPLIT_PATTERN. It returns what pcre_exec
+// returns for that pattern: the leftmost match, PCRE_ERROR_PARTIAL under
+// PCRE_PARTIAL_HARD when the match depends on bytes past the end, and
+// PCRE_ERROR_BADUTF8 unless PCRE_NO_UTF8_CHECK is given (where PCRE may say
+// PCRE_ERROR_SHORTUTF8 for a character cut off at the end; callers treat both
+// alike). \s is ASCII only, as in PCRE without PCRE_UCP.
+
+enum
+{
+    CHAR_SPACE,
+    CHAR_LETTER,
+    CHAR_NUMBER,
+    CHAR_OTHER
+};
+
+#define SPLIT_CLASS_TABLE_SIZE 0x800
+
+// Classes of every code point with a one or two byte UTF-8 encoding
+static unsigned char split_class_table[SPLIT_CLASS_TABLE_SIZE];
+static pthread_once_t split_class_once = PTHREAD_ONCE_INIT;
+
+static bool in_unicode_ranges(const UnicodeRange *ranges, int size, uint32_t code_point)
+{
+    int lo = 0;
+    int hi = size - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (code_point < ranges[mid].first)
+            hi = mid - 1;
+        else if (code_point > ranges[mid].last)
+            lo = mid + 1;
+        else
+            return true;
+    }
+    return false;
+}
+
+static int lookup_char_class(uint32_t code_point)
+{
+    if (code_point == ' ' || (code_point >= '\t' && code_point <= '\r'))
+        return CHAR_SPACE;
+    if (in_unicode_ranges(unicode_letter_ranges, unicode_letter_ranges_size, code_point))
+        return CHAR_LETTER;
+    if (in_unicode_ranges(unicode_number_ranges, unicode_number_ranges_size, code_point))
+        return CHAR_NUMBER;
+    return CHAR_OTHER;
+}
+
+static void init_split_class_table(void)
+{
+    for (uint32_t cp = 0; cp < SPLIT_CLASS_TABLE_SIZE; ++cp)
+    {
+        split_class_table[cp] = (unsigned char)lookup_char_class(cp);
+    }
+}
+
+// Decodes the character at bytes, which is valid UTF-8, and sets *width to its length
+static uint32_t decode_utf8_char(const unsigned char *bytes, int *width)
+{
+    unsigned char c = bytes[0];
+    if (c < 0x80)
+    {
+        *width = 1;
+        return c;
+    }
+    if (c < 0xE0)
+    {
+        *width = 2;
+        return ((c & 0x1F) << 6) | (bytes[1] & 0x3F);
+    }
+    if (c < 0xF0)
+    {
+        *width = 3;
+        return ((c & 0x0F) << 12) | ((bytes[1] & 0x3F) << 6) | (bytes[2] & 0x3F);
+    }
+    *width = 4;
+    return ((c & 0x07) << 18) | ((bytes[1] & 0x3F) << 12) | ((bytes[2] & 0x3F) << 6) | (bytes[3] & 0x3F);
+}
+
+static int encode_utf8_char(uint32_t code_point, unsigned char *bytes)
+{
+    if (code_point < 0x80)
+    {
+        bytes[0] = (unsigned char)code_point;
+        return 1;
+    }
+    if (code_point < 0x800)
+    {
+        bytes[0] = (unsigned char)(0xC0 | (code_point >> 6));
+        bytes[1] = (unsigned char)(0x80 | (code_point & 0x3F));
+        return 2;
+    }
+    if (code_point < 0x10000)
+    {
+        bytes[0] = (unsigned char)(0xE0 | (code_point >> 12));
+        bytes[1] = (unsigned char)(0x80 | ((code_point >> 6) & 0x3F));
+        bytes[2] = (unsigned char)(0x80 | (code_point & 0x3F));
+        return 3;
+    }
+    bytes[0] = (unsigned char)(0xF0 | (code_point >> 18));
+    bytes[1] = (unsigned char)(0x80 | ((code_point >> 12) & 0x3F));
+    bytes[2] = (unsigned char)(0x80 | ((code_point >> 6) & 0x3F));
+    bytes[3] = (unsigned char)(0x80 | (code_point & 0x3F));
+    return 4;
+}
+
+// True if the runs of consecutive code points that class_pattern matches in
+// subject, every code point in order, are exactly ranges
+static bool unicode_ranges_match_pcre(const char *class_pattern, const UnicodeRange *ranges, int size, const char *subject, int length)
+{
+    const char *error;
+    int erroffset;
+    pcre *re = pcre_compile(class_pattern, PCRE_UTF8, &error, &erroffset, NULL);
+    if (re == NULL)
+    {
+        return false;
+    }
+    pcre_extra *extra = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &error);
+    const unsigned char *bytes = (const unsigned char *)subject;
+    bool same = true;
+    int found = 0;
+    int start = 0;
+    int options = 0;
+    int ovector[3];
+    while (same && pcre_exec(re, extra, subject, length, start, options, ovector, 3) >= 0)
+    {
+        int width;
+        int last = ovector[1] - 1;
+        while ((bytes[last] & 0xC0) == 0x80)
+        {
+            last--;
+        }
+        same = found < size && ranges[found].first == decode_utf8_char(bytes + ovector[0], &width) &&
+               ranges[found].last == decode_utf8_char(bytes + last, &width);
+        found++;
+        start = ovector[1];
+        options = PCRE_NO_UTF8_CHECK;
+    }
+    if (extra)
+    {
+        pcre_free_study(extra);
+    }
+    pcre_free(re);
+    return same && found == size;
+}
+
+static bool gpt2_tables_match_pcre;
+static pthread_once_t gpt2_tables_once = PTHREAD_ONCE_INIT;
+
+// The tables are generated from one Unicode version and the linked PCRE may
+// know another; libpcre1's last release predates Unicode 14, so letters added
+// since are \p{L} to the tables but not to PCRE. Both classes are matched over
+// every code point once, and any difference leaves the GPT-2 pattern to PCRE.
+static void check_gpt2_tables(void)
+{
+    char *subject = (char *)counted_malloc(4 * 0x110000);
+    if (subject == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    int length = 0;
+    for (uint32_t cp = 0; cp <= 0x10FFFF; ++cp)
+    {
+        if (cp < 0xD800 || cp > 0xDFFF)
+        {
+            length += encode_utf8_char(cp, (unsigned char *)subject + length);
+        }
+    }
+    gpt2_tables_match_pcre =
+        unicode_ranges_match_pcre("\\p{L}+", unicode_letter_ranges, unicode_letter_ranges_size, subject, length) &&
+        unicode_ranges_match_pcre("\\p{N}+", unicode_number_ranges, unicode_number_ranges_size, subject, length);
+    free(subject);
+}
+
+static bool gpt2_scanner_matches_pcre(void)
+{
+    pthread_once(&gpt2_tables_once, check_gpt2_tables);
+    return gpt2_tables_match_pcre;
+}
+
+// Decodes the character at bytes[pos] (input is valid UTF-8) and returns its class
+static int next_char_class(const unsigned char *bytes, int pos, int *width)
+{
+    unsigned char c = bytes[pos];
+    if (c < 0x80)
+    {
+        *width = 1;
+        return split_class_table[c];
+    }
+    if (c < 0xE0)
+    {
+        *width = 2;
+        return split_class_table[((c & 0x1F) << 6) | (bytes[pos + 1] & 0x3F)];
+    }
+    return lookup_char_class(decode_utf8_char(bytes + pos, width));
+}
+
+// End of the run of characters of class cls starting at pos
+static int skip_char_class(const unsigned char *bytes, int length, int pos, int cls, bool *hit_end)
+{
+    int width;
+    while (pos < length && next_char_class(bytes, pos, &width) == cls)
+    {
+        pos += width;
+    }
+    if (pos == length)
+    {
+        *hit_end = true;
+    }
+    return pos;
+}
+
+static int gpt2_split_exec(const char *subject, int length, int options, int *ovector)
+{
+    const unsigned char *bytes = (const unsigned char *)subject;
+    if (!(options & PCRE_NO_UTF8_CHECK) && !is_valid_utf8(bytes, length))
+    {
+        return PCRE_ERROR_BADUTF8;
+    }
+    if (length == 0)
+    {
+        return PCRE_ERROR_NOMATCH;
+    }
+    pthread_once(&split_class_once, init_split_class_table);
+
+    bool hit_end = false;
+    int end = -1;
+    int width;
+    int cls = next_char_class(bytes, 0, &width);
+
+    // '(?:[sdmt]|ll|ve|re)
+    if (bytes[0] == '\'')
+    {
+        if (length < 2)
+            hit_end = true;
+        else if (bytes[1] == 's' || bytes[1] == 'd' || bytes[1] == 'm' || bytes[1] == 't')
+            end = 2;
+        else if (bytes[1] == 'l' || bytes[1] == 'v' || bytes[1] == 'r')
+        {
+            if (length < 3)
+                hit_end = true;
+            else if ((bytes[1] == 'l' && bytes[2] == 'l') || (bytes[1] != 'l' && bytes[2] == 'e'))
+                end = 3;
+        }
+    }
+
+    // ' ?\p{L}+', ' ?\p{N}+' and ' ?[^\s\p{L}\p{N}]+', in that order
+    if (end < 0)
+    {
+        int start = 0;
+        int run_class = cls;
+        if (bytes[0] == ' ')
+        {
+            if (length < 2)
+                hit_end = true;
+            else
+            {
+                start = 1;
+                run_class = next_char_class(bytes, 1, &width);
+            }
+        }
+        if (run_class != CHAR_SPACE)
+        {
+            end = skip_char_class(bytes, length, start, run_class, &hit_end);
+        }
+    }
+
+    // '\s+(?!\S)' backs off one character before a non-space; '\s+' takes the run
+    if (end < 0 && cls == CHAR_SPACE)
+    {
+        int run = skip_char_class(bytes, length, 0, CHAR_SPACE, &hit_end);
+        end = run < length && run > 1 ? run - 1 : run;
+    }
+
+    if (end < 0)
+    {
+        return PCRE_ERROR_NOMATCH;
+    }
+    if (hit_end && (options & PCRE_PARTIAL_HARD))
+    {
+        ovector[0] = 0;
+        ovector[1] = length;
+        return PCRE_ERROR_PARTIAL;
+    }
+    ovector[0] = 0;
+    ovector[1] = end;
+    return 1;
+}
+
+// pcre_exec with the tokenizer's pattern, or the hand-written splitter when it applies
+static int split_exec(const RegexTokenizer *tokenizer, const char *subject, int length, int options, int *ovector, int ovecsize)
+{
+    if (tokenizer->split_scanner == SPLIT_SCANNER_GPT2)
+    {
+        return gpt2_split_exec(subject, length, options, ovector);
+    }
+    return pcre_exec(tokenizer->compiled_pattern, tokenizer->compiled_pattern_extra, subject, length, 0, options, ovector, ovecsize);
+}
+
+// Where a split of text has got to; next_piece moves it one match at a time
+typedef struct
+{
+    const char *ptr;
+    const char *end;
+    int options;
+} PieceCursor;
+
+static void init_piece_cursor(PieceCursor *cursor, const char *text, size_t length, int options)
+{
+    cursor->ptr = text;
+    cursor->end = text + length;
+    cursor->options = options;
+}
+
+// Finds the next match after the cursor and returns the split_exec result. On
+// a match, sets *piece and *length to it and moves the cursor past it;
+// otherwise the cursor stays where the failed search started.
+static int next_piece(const RegexTokenizer *tokenizer, PieceCursor *cursor, const char **piece, int *length)
+{
+    int ovector[30];
+    int rc = split_exec(tokenizer, cursor->ptr, (int)(cursor->end - cursor->ptr), cursor->options, ovector, 30);
+    if (rc >= 0)
+    {
+        *piece = cursor->ptr + ovector[0];
+        *length = ovector[1] - ovector[0];
+        cursor->ptr += ovector[1];
+        // The first call validated the whole subject and matches end on character boundaries
+        cursor->options |= PCRE_NO_UTF8_CHECK;
+    }
+    return rc;
+}
+
+// Splits text with the compiled pattern and adds every match to chunks. With
+// PCRE_PARTIAL_HARD in options, matches that could change with more text are
+// left out. Sets *end to where the scan stopped and returns the split_exec
+// result that stopped it.
+static int count_text_chunks(RegexTokenizer *tokenizer, const char *text, size_t length, int options, ChunkCountTable *chunks, size_t *end)
+{
+    int rc;
+    PieceCursor cursor;
+    init_piece_cursor(&cursor, text, length, options);
+    const char *piece;
+    int piece_length;
+    while ((rc = next_piece(tokenizer, &cursor, &piece, &piece_length)) >= 0)
+    {
+        add_chunk_count(chunks, piece, piece_length, 1);
+    }
+    *end = cursor.ptr - text;
+    return rc;
+}
+
+#define SPLIT_SYNC_WINDOW 64
+#define SPLIT_MIN_SHARD_BYTES (64 * 1024)
+
+// One worker's view of the text. A worker starting mid-text may not land on a
+// match boundary of the sequential scan, so its first matches are held back
+// until the reduce knows where the previous shard's scan rejoins this one.
+typedef struct
+{
+    RegexTokenizer *tokenizer;
+    const char *text;
+    size_t length;
+    size_t start;
+    size_t end;
+    int options;
+    size_t final_pos;
+    bool valid;
+    bool stopped;
+    int stop_rc;
+    int num_pending;
+    size_t sync_pos[SPLIT_SYNC_WINDOW + 1];
+    Chunk pending[SPLIT_SYNC_WINDOW];
+    ChunkCountTable chunks;
+} SplitShard;
+
+static void *count_shard_chunks(void *arg)
+{
+    SplitShard *shard = (SplitShard *)arg;
+    int ovector[30];
+    shard->valid = is_valid_utf8((const unsigned char *)shard->text + shard->start, shard->end - shard->start);
+    size_t pos = shard->start;
+    shard->sync_pos[0] = pos;
+    while (shard->valid && pos < shard->end)
+    {
+        // The subject runs to the end of the text so lookaheads see what a sequential scan sees
+        int rc = split_exec(shard->tokenizer, shard->text + pos, shard->length - pos, shard->options | PCRE_NO_UTF8_CHECK, ovector, 30);
+        if (rc < 0)
+        {
+            shard->stopped = true;
+            shard->stop_rc = rc;
+            break;
+        }
+        if (shard->num_pending < SPLIT_SYNC_WINDOW)
+        {
+            shard->pending[shard->num_pending].offset = pos + ovector[0];
+            shard->pending[shard->num_pending].length = ovector[1] - ovector[0];
+            shard->sync_pos[++shard->num_pending] = pos + ovector[1];
+        }
+        else
+        {
+            add_chunk_count(&shard->chunks, shard->text + pos + ovector[0], ovector[1] - ovector[0], 1);
+        }
+        pos += ovector[1];
+    }
+    shard->final_pos = pos;
+    return NULL;
+}
+
+// Runs one step of the sequential scan from *pos; returns false, setting *rc,
+// once the scan would stop
+static bool scan_next_chunk(RegexTokenizer *tokenizer, const char *text, size_t length, int options, size_t *pos, ChunkCountTable *chunks,
+                            int *rc)
+{
+    int ovector[30];
+    *rc = split_exec(tokenizer, text + *pos, length - *pos, options | PCRE_NO_UTF8_CHECK, ovector, 30);
+    if (*rc < 0)
+    {
+        return false;
+    }
+    add_chunk_count(chunks, text + *pos + ovector[0], ovector[1] - ovector[0], 1);
+    *pos += ovector[1];
+    return true;
+}
+
+// Parallel version of count_text_chunks. Shards are folded in text order and
+// their chunk tables in insertion order, so chunks keep the order of first
+// appearance that the sequential scan produces. Returns 0 instead of a
+// split_exec result when the shards scanned to the end.
+static int count_text_chunks_parallel(RegexTokenizer *tokenizer, const char *text, size_t length, int options, ChunkCountTable *chunks,
+                                      int num_threads, size_t *end_pos)
+{
+    if ((size_t)num_threads > length / SPLIT_MIN_SHARD_BYTES)
+    {
+        num_threads = (int)(length / SPLIT_MIN_SHARD_BYTES);
+    }
+    if (num_threads <= 1)
+    {
+        return count_text_chunks(tokenizer, text, length, options, chunks, end_pos);
+    }
+
+    SplitShard *shards = (SplitShard *)counted_calloc(num_threads, sizeof(SplitShard));
+    pthread_t *threads = (pthread_t *)counted_malloc(num_threads * sizeof(pthread_t));
+    if (shards == NULL || threads == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    size_t start = 0;
+    for (int t = 0; t < num_threads; ++t)
+    {
+        size_t end = t + 1 == num_threads ? length : length / num_threads * (t + 1);
+        // Never cut through a UTF-8 sequence
+        while (end < length && ((unsigned char)text[end] & 0xC0) == 0x80)
+        {
+            end++;
+        }
+        if (end < start)
+        {
+            end = start;
+        }
+        shards[t].tokenizer = tokenizer;
+        shards[t].text = text;
+        shards[t].length = length;
+        shards[t].start = start;
+        shards[t].end = end;
+        shards[t].options = options;
+        init_chunk_count_table(&shards[t].chunks, 1024);
+        if (pthread_create(&threads[t], NULL, count_shard_chunks, &shards[t]) != 0)
+        {
+            fprintf(stderr, "Failed to create training thread\n");
+            exit(1);
+        }
+        start = end;
+    }
+    bool valid = true;
+    for (int t = 0; t < num_threads; ++t)
+    {
+        pthread_join(threads[t], NULL);
+        valid = valid && shards[t].valid;
+    }
+
+    // Invalid UTF-8 anywhere makes the sequential scan fail on its first call
+    size_t pos = 0;
+    int rc = PCRE_ERROR_BADUTF8;
+    for (int t = 0; valid && t < num_threads; ++t)
+    {
+        SplitShard *shard = &shards[t];
+        int sync = -1;
+        bool running = true;
+        while (running)
+        {
+            for (int k = 0; k <= shard->num_pending && sync < 0; ++k)
+            {
+                if (shard->sync_pos[k] == pos)
+                {
+                    sync = k;
+                }
+            }
+            if (sync >= 0 || pos > shard->sync_pos[shard->num_pending])
+            {
+                break;
+            }
+            running = scan_next_chunk(tokenizer, text, length, options, &pos, chunks, &rc);
+        }
+        if (!running)
+        {
+            break;
+        }
+        if (sync < 0)
+        {
+            // The sequential scan skipped past this shard's held-back matches: redo it
+            while (running && pos < shard->end)
+            {
+                running = scan_next_chunk(tokenizer, text, length, options, &pos, chunks, &rc);
+            }
+            if (!running)
+            {
+                break;
+            }
+            continue;
+        }
+        for (int k = sync; k < shard->num_pending; ++k)
+        {
+            add_chunk_count(chunks, text + shard->pending[k].offset, shard->pending[k].length, 1);
+        }
+        for (int i = 0; i < shard->chunks.size; ++i)
+        {
+            const Chunk *chunk = &shard->chunks.chunks[i];
+            add_chunk_count(chunks, shard->chunks.bytes + chunk->offset, chunk->length, shard->chunks.counts[i]);
+        }
+        pos = shard->final_pos;
+        rc = shard->stop_rc;
+        if (shard->stopped)
+        {
+            break;
+        }
+    }
+
+    for (int t = 0; t < num_threads; ++t)
+    {
+        free_chunk_count_table(&shards[t].chunks);
+    }
+    free(threads);
+    free(shards);
+    *end_pos = pos;
+    return rc;
+}
+
+void init_train_options(TrainOptions *options)
+{
+    options->num_threads = 1;
+    options->max_unique_chunks = 0;
+    options->max_chunk_bytes = TRAIN_MAX_CHUNK_BYTES;
+    options->extend_merges = false;
+    options->progress = NULL;
+    options->progress_user_data = NULL;
+    options->progress_interval = 1.0;
+    options->checkpoint_path = NULL;
+    options->checkpoint_interval = 600.0;
+}
+
+static int compare_counts_desc(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x < y) - (x > y);
+}
+
+// Keeps the max_chunks most frequent chunks, earlier ones first among equal
+// counts, in their original order
+static void prune_chunk_count_table(ChunkCountTable *table, int max_chunks)
+{
+    if (table->size <= max_chunks)
+    {
+        return;
+    }
+    long long *sorted = (long long *)counted_malloc(table->size * sizeof(long long));
+    if (sorted == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(sorted, table->counts, table->size * sizeof(long long));
+    qsort(sorted, table->size, sizeof(long long), compare_counts_desc);
+    long long threshold = sorted[max_chunks - 1];
+    int above = 0;
+    while (above < max_chunks && sorted[above] > threshold)
+    {
+        above++;
+    }
+    int ties_left = max_chunks - above;
+    free(sorted);
+
+    ChunkCountTable kept;
+    init_chunk_count_table(&kept, max_chunks);
+    for (int i = 0; i < table->size; ++i)
+    {
+        long long count = table->counts[i];
+        if (count > threshold || (count == threshold && ties_left-- > 0))
+        {
+            const Chunk *chunk = &table->chunks[i];
+            add_chunk_count(&kept, table->bytes + chunk->offset, chunk->length, count);
+        }
+    }
+    free_chunk_count_table(table);
+    *table = kept;
+}
+
+void train_regex_tokenizer(RegexTokenizer *tokenizer, const char *text, int vocab_size)
+{
+    TrainOptions options;
+    init_train_options(&options);
+    train_regex_tokenizer_with_options(tokenizer, text, vocab_size, &options);
+}
+
+// Merges touching fewer positions than this per thread are applied serially
+#define PARALLEL_MERGE_MIN_POSITIONS 16384
+
+static bool can_train(const RegexTokenizer *tokenizer, int vocab_size, const TrainOptions *options)
+{
+    if (tokenizer->mapping)
+    {
+        fprintf(stderr, "Cannot train a tokenizer mapped from a binary model\n");
+        return false;
+    }
+    if (vocab_size < 256)
+    {
+        fprintf(stderr, "Vocab size must be at least 256\n");
+        return false;
+    }
+    if (options->max_chunk_bytes > TRAIN_MAX_CHUNK_BYTES)
+    {
+        fprintf(stderr, "Chunk byte cap %zu is above the %zu training supports\n", options->max_chunk_bytes, TRAIN_MAX_CHUNK_BYTES);
+        return false;
+    }
+    int kept = 256 + (options->extend_merges ? tokenizer->merge_size : 0);
+    if (vocab_size < kept)
+    {
+        fprintf(stderr, "Vocab size %d is below the %d tokens already learned\n", vocab_size, kept);
+        return false;
+    }
+    // New merges take the ids after the kept ones
+    for (int i = 0; i < tokenizer->special_size; ++i)
+    {
+        if (tokenizer->special_tokens[i] >= kept && tokenizer->special_tokens[i] < vocab_size)
+        {
+            fprintf(stderr, "Special token id %d is needed for a new merge\n", tokenizer->special_tokens[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+#define TRAIN_CHECKPOINT_MAGIC "MINBPEC"
+#define TRAIN_CHECKPOINT_VERSION 1
+
+// Laid out like the binary model: a header, then 8-byte aligned sections
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t vocab_size; // target of the interrupted run
+    uint32_t merge_size; // merges learned so far
+    uint32_t chunk_count;
+    uint32_t pattern_length;
+    uint32_t reserved;
+    uint64_t merges_offset;
+    uint64_t chunk_lengths_offset; // int32 per chunk
+    uint64_t chunk_counts_offset;  // int64 per chunk
+    uint64_t chunk_bytes_offset;
+    uint64_t chunk_bytes_size;
+    uint64_t pattern_offset;
+    uint64_t file_size;
+    uint64_t checksum; // FNV-1a over the 64-bit words after the header
+} TrainCheckpointHeader;
+
+// Writes the merges so far and the chunk counts they were learned from. The
+// file is written beside the target and renamed over it, so a run killed
+// mid-write leaves the previous checkpoint intact.
+static bool save_train_checkpoint(const RegexTokenizer *tokenizer, const ChunkCountTable *chunks, int vocab_size, const char *path)
+{
+    TrainCheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRAIN_CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = TRAIN_CHECKPOINT_VERSION;
+    header.byte_order = BINARY_MODEL_BYTE_ORDER;
+    header.header_size = sizeof(TrainCheckpointHeader);
+    header.vocab_size = vocab_size;
+    header.merge_size = tokenizer->merge_size;
+    header.chunk_count = chunks->size;
+    header.pattern_length = strlen(tokenizer->pattern);
+    header.chunk_bytes_size = 0;
+    for (int i = 0; i < chunks->size; ++i)
+    {
+        header.chunk_bytes_size += chunks->chunks[i].length;
+    }
+    header.merges_offset = align_model_offset(sizeof(TrainCheckpointHeader));
+    header.chunk_lengths_offset = align_model_offset(header.merges_offset + (uint64_t)header.merge_size * sizeof(Pair));
+    header.chunk_counts_offset = align_model_offset(header.chunk_lengths_offset + (uint64_t)header.chunk_count * sizeof(int32_t));
+    header.chunk_bytes_offset = align_model_offset(header.chunk_counts_offset + (uint64_t)header.chunk_count * sizeof(int64_t));
+    header.pattern_offset = align_model_offset(header.chunk_bytes_offset + header.chunk_bytes_size);
+    header.file_size = align_model_offset(header.pattern_offset + header.pattern_length + 1);
+
+    char *data = (char *)counted_calloc(header.file_size, 1);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for training checkpoint\n");
+        exit(1);
+    }
+    memcpy(data + header.merges_offset, tokenizer->merges, (size_t)header.merge_size * sizeof(Pair));
+    uint64_t bytes_offset = header.chunk_bytes_offset;
+    for (int i = 0; i < chunks->size; ++i)
+    {
+        const Chunk *chunk = &chunks->chunks[i];
+        int32_t length = chunk->length;
+        int64_t count = chunks->counts[i];
+        memcpy(data + header.chunk_lengths_offset + i * sizeof(int32_t), &length, sizeof(int32_t));
+        memcpy(data + header.chunk_counts_offset + i * sizeof(int64_t), &count, sizeof(int64_t));
+        memcpy(data + bytes_offset, chunks->bytes + chunk->offset, chunk->length);
+        bytes_offset += chunk->length;
+    }
+    memcpy(data + header.pattern_offset, tokenizer->pattern, header.pattern_length);
+    header.checksum = checksum_model_words(data + sizeof(TrainCheckpointHeader), header.file_size - sizeof(TrainCheckpointHeader));
+    memcpy(data, &header, sizeof(header));
+
+    size_t path_length = strlen(path);
+    char *temp_path = (char *)counted_malloc(path_length + 5);
+    if (temp_path == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for training checkpoint\n");
+        exit(1);
+    }
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+    FILE *f = fopen(temp_path, "wb");
+    bool ok = f != NULL;
+    if (ok)
+    {
+        ok = fwrite(data, 1, header.file_size, f) == header.file_size;
+        ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(temp_path, path) == 0;
+    }
+    if (!ok)
+    {
+        perror("Failed to write training checkpoint");
+        remove(temp_path);
+    }
+    free(temp_path);
+    free(data);
+    return ok;
+}
+
+static bool checkpoint_section_fits(const TrainCheckpointHeader *header, uint64_t offset, uint64_t length)
+{
+    return offset % 8 == 0 && offset >= sizeof(TrainCheckpointHeader) && offset <= header->file_size &&
+           length <= header->file_size - offset;
+}
+
+// Returns NULL when the checkpoint can be resumed from, otherwise what is wrong with it
+static const char *check_train_checkpoint(const char *data, size_t size)
+{
+    const TrainCheckpointHeader *header = (const TrainCheckpointHeader *)data;
+    if (size < sizeof(TrainCheckpointHeader) || memcmp(header->magic, TRAIN_CHECKPOINT_MAGIC, sizeof(header->magic)) != 0)
+        return "not a training checkpoint";
+    if (header->version != TRAIN_CHECKPOINT_VERSION)
+        return "unsupported version";
+    if (header->byte_order != BINARY_MODEL_BYTE_ORDER)
+        return "written with a different byte order";
+    if (header->header_size != sizeof(TrainCheckpointHeader) || header->file_size != size || size % 8 != 0)
+        return "truncated or resized";
+    if (header->vocab_size < 256 || header->vocab_size > (uint32_t)INT32_MAX || header->merge_size > header->vocab_size - 256 ||
+        header->chunk_count > (uint32_t)INT32_MAX || header->chunk_bytes_size > (uint64_t)INT32_MAX)
+        return "inconsistent sizes";
+    if (!checkpoint_section_fits(header, header->merges_offset, (uint64_t)header->merge_size * sizeof(Pair)) ||
+        !checkpoint_section_fits(header, header->chunk_lengths_offset, (uint64_t)header->chunk_count * sizeof(int32_t)) ||
+        !checkpoint_section_fits(header, header->chunk_counts_offset, (uint64_t)header->chunk_count * sizeof(int64_t)) ||
+        !checkpoint_section_fits(header, header->chunk_bytes_offset, header->chunk_bytes_size) ||
+        !checkpoint_section_fits(header, header->pattern_offset, (uint64_t)header->pattern_length + 1))
+        return "section out of bounds";
+    if (checksum_model_words(data + sizeof(TrainCheckpointHeader), size - sizeof(TrainCheckpointHeader)) != header->checksum)
+        return "checksum mismatch";
+
+    const Pair *merges = (const Pair *)(data + header->merges_offset);
+    for (uint32_t i = 0; i < header->merge_size; ++i)
+    {
+        int idx = 256 + (int)i;
+        if (merges[i].first < 0 || merges[i].first >= idx || merges[i].second < 0 || merges[i].second >= idx)
+            return "invalid merge";
+    }
+    const int32_t *lengths = (const int32_t *)(data + header->chunk_lengths_offset);
+    const int64_t *counts = (const int64_t *)(data + header->chunk_counts_offset);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < header->chunk_count; ++i)
+    {
+        if (lengths[i] <= 0 || counts[i] <= 0)
+            return "invalid chunk";
+        total += lengths[i];
+    }
+    if (total != header->chunk_bytes_size)
+        return "chunk lengths do not match chunk bytes";
+    const char *pattern = data + header->pattern_offset;
+    if (pattern[header->pattern_length] != '\0' || strlen(pattern) != header->pattern_length)
+        return "invalid pattern";
+    return NULL;
+}
+
+// Every unique chunk byte becomes a train node with an int index
+static bool chunk_bytes_fit(size_t bytes_size, const TrainOptions *options)
+{
+    if (bytes_size > options->max_chunk_bytes)
+    {
+        fprintf(stderr, "Unique chunks take %zu bytes, over the cap of %zu; set max_unique_chunks to keep fewer\n", bytes_size,
+                options->max_chunk_bytes);
+        return false;
+    }
+    return true;
+}
+
+// Learns merges from counted chunks until there are vocab_size - 256. With
+// extend_merges the tokenizer's merges are kept, applied to the chunks by
+// rank first, and learning continues after them; otherwise they are replaced.
+// Returns false, leaving the tokenizer unchanged, if the chunks are over the
+// byte cap.
+static bool train_from_chunks(RegexTokenizer *tokenizer, ChunkCountTable *chunks, int vocab_size, const TrainOptions *options)
+{
+    int num_merges = vocab_size - 256;
+    int num_threads = options->num_threads > 1 ? options->num_threads : 1;
+    if (options->max_unique_chunks > 0)
+    {
+        prune_chunk_count_table(chunks, options->max_unique_chunks);
+    }
+    if (!chunk_bytes_fit(chunks->bytes_size, options))
+    {
+        return false;
+    }
+    int kept_merges = options->extend_merges ? tokenizer->merge_size : 0;
+    tokenizer->merge_size = kept_merges;
+    build_merge_ranks(tokenizer);
+
+    // Count every consecutive pair once; merges then only touch their neighbours
+    TrainState state;
+    init_train_state(&state, chunks, tokenizer);
+    MergePool pool;
+    if (num_threads > 1)
+    {
+        init_merge_pool(&pool, num_threads);
+    }
+
+    double start = monotonic_seconds();
+    double last_progress = start;
+    double last_checkpoint = start;
+    for (int i = kept_merges; i < num_merges; ++i)
+    {
+        // Find the pair with the highest count, earliest first occurrence on ties
+        int best = pop_best_pair(&state);
+        if (best < 0)
+        {
+            fprintf(stderr, "No pairs left to merge after %d merges\n", i);
+            break;
+        }
+        Pair max_pair = state.index.pairs[best];
+        long long max_count = state.pairs[best].count;
+
+        // Mint a new token and replace all occurrences of the pair with it
+        int idx = 256 + i;
+        if (num_threads > 1 && state.pairs[best].positions.size >= PARALLEL_MERGE_MIN_POSITIONS * num_threads)
+        {
+            apply_train_merge_parallel(&state, best, idx, i + 1, &pool);
+        }
+        else
+        {
+            apply_train_merge(&state, best, idx, i + 1);
+        }
+        append_merge(tokenizer, max_pair);
+        TRACE(TRACE_LEVEL_CALLS, .type = TRACE_TRAIN_MERGE, .pair = max_pair, .id = idx, .count = max_count);
+
+        if (options->progress == NULL && options->checkpoint_path == NULL)
+        {
+            continue;
+        }
+        double now = monotonic_seconds();
+        bool stop = false;
+        if (options->progress && (now - last_progress >= options->progress_interval || i + 1 == num_merges))
+        {
+            TrainProgress progress;
+            progress.merges_done = i + 1;
+            progress.merges_total = num_merges;
+            progress.best_count = max_count;
+            progress.elapsed_seconds = now - start;
+            progress.merges_per_second = now > start ? (i + 1 - kept_merges) / (now - start) : 0.0;
+            progress.eta_seconds = progress.merges_per_second > 0.0 ? (num_merges - i - 1) / progress.merges_per_second : 0.0;
+            stop = !options->progress(options->progress_user_data, &progress);
+            last_progress = now;
+        }
+        // A run stopped early is checkpointed so it can pick up where it left off
+        if (options->checkpoint_path && i + 1 < num_merges && (stop || now - last_checkpoint >= options->checkpoint_interval))
+        {
+            save_train_checkpoint(tokenizer, chunks, vocab_size, options->checkpoint_path);
+            last_checkpoint = monotonic_seconds();
+        }
+        if (stop)
+        {
+            break;
+        }
+    }
+
+    if (num_threads > 1)
+    {
+        free_merge_pool(&pool);
+    }
+    free_train_state(&state);
+    build_vocab(tokenizer);
+    build_merge_ranks(tokenizer);
+    if (tokenizer->cache)
+    {
+        clear_encode_cache(tokenizer->cache);
+    }
+    return true;
+}
+
+// Bytes of a file split per pass. Bounds the file pages resident at once.
+#define TRAIN_FILE_WINDOW (64 * 1024 * 1024)
+
+// Adds the chunks of text, split window_size bytes at a time since split_exec
+// lengths must fit in an int. Matches that could still grow are left for the
+// next window, so the counts equal those of splitting the whole text at once.
+// With release, windows already split are dropped from memory, which only
+// suits a file mapping. name identifies the text in errors.
+static bool count_chunks_in_windows(RegexTokenizer *tokenizer, const char *name, const char *data, size_t size, size_t window_size,
+                                    bool release, ChunkCountTable *chunks, const TrainOptions *options)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pos = 0;
+    size_t released = 0;
+    while (pos < size)
+    {
+        size_t window = size - pos < window_size ? size - pos : window_size;
+        bool last = pos + window == size;
+        if (!last)
+        {
+            window = complete_utf8_prefix(data + pos, window);
+        }
+        size_t end;
+        int rc = count_text_chunks_parallel(tokenizer, data + pos, window, last ? 0 : PCRE_PARTIAL_HARD, chunks, options->num_threads, &end);
+        if (rc == PCRE_ERROR_BADUTF8 || rc == PCRE_ERROR_SHORTUTF8 || (rc == PCRE_ERROR_PARTIAL && end == 0))
+        {
+            fprintf(stderr, "Cannot split %s at offset %zu: %s\n", name, pos + end,
+                    rc == PCRE_ERROR_PARTIAL ? "chunk longer than the split window" : "invalid UTF-8");
+            return false;
+        }
+        if (rc < 0 && rc != PCRE_ERROR_NOMATCH && rc != PCRE_ERROR_PARTIAL)
+        {
+            fprintf(stderr, "Cannot split %s at offset %zu: PCRE error %d\n", name, pos + end, rc);
+            return false;
+        }
+        if (rc == PCRE_ERROR_NOMATCH)
+        {
+            if (last)
+            {
+                break; // The pattern matches nothing further, as with a single pass
+            }
+            // Nothing in the window can start a match, even with more text after it
+            end = window;
+        }
+        pos += end;
+        size_t release_end = pos / page_size * page_size;
+        if (release && release_end > released)
+        {
+            madvise((char *)data + released, release_end - released, MADV_DONTNEED);
+            released = release_end;
+        }
+        if (options->max_unique_chunks > 0 && chunks->size > options->max_unique_chunks)
+        {
+            prune_chunk_count_table(chunks, options->max_unique_chunks / 2 > 0 ? options->max_unique_chunks / 2 : 1);
+        }
+        // Without pruning the table only grows, so splitting further is no use
+        if (options->max_unique_chunks == 0 && !chunk_bytes_fit(chunks->bytes_size, options))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Trains on text, which must be valid UTF-8. Texts longer than an int are
+// split in int-sized windows. On invalid UTF-8, a failed split or chunks over
+// max_chunk_bytes, nothing is learned and the tokenizer is left unchanged.
+void train_regex_tokenizer_with_options(RegexTokenizer *tokenizer, const char *text, int vocab_size, const TrainOptions *options)
+{
+    if (!can_train(tokenizer, vocab_size, options))
+    {
+        return;
+    }
+    // Split the text into chunks and count each unique chunk once
+    ChunkCountTable chunks;
+    init_chunk_count_table(&chunks, 1024);
+    if (count_chunks_in_windows(tokenizer, "text", text, strlen(text), INT32_MAX, false, &chunks, options))
+    {
+        train_from_chunks(tokenizer, &chunks, vocab_size, options);
+    }
+    free_chunk_count_table(&chunks);
+}
+
+// Trains on the concatenated chunk statistics of several files without
+// loading them: each file is mapped and split in windows, so memory grows with
+// the number of unique chunks rather than with the corpus. With
+// max_unique_chunks set, the chunk table is pruned to its most frequent half
+// whenever it outgrows the cap, bounding memory at the cost of exact counts.
+// Returns false, leaving the tokenizer unchanged, if a file cannot be read or
+// the unique chunks are over max_chunk_bytes.
+bool train_regex_tokenizer_from_files(RegexTokenizer *tokenizer, const char *const *paths, int num_paths, int vocab_size,
+                                      const TrainOptions *options)
+{
+    if (!can_train(tokenizer, vocab_size, options))
+    {
+        return false;
+    }
+    ChunkCountTable chunks;
+    init_chunk_count_table(&chunks, 1024);
+    bool ok = true;
+    for (int i = 0; ok && i < num_paths; ++i)
+    {
+        int fd = open(paths[i], O_RDONLY);
+        if (fd < 0)
+        {
+            perror("Failed to open training file");
+            ok = false;
+            break;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            perror("Failed to stat training file");
+            close(fd);
+            ok = false;
+            break;
+        }
+        size_t size = (size_t)st.st_size;
+        if (size == 0)
+        {
+            close(fd);
+            continue;
+        }
+        void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            perror("Failed to map training file");
+            ok = false;
+            break;
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        ok = count_chunks_in_windows(tokenizer, paths[i], (const char *)mapping, size, TRAIN_FILE_WINDOW, true, &chunks, options);
+        munmap(mapping, size);
+    }
+    if (ok)
+    {
+        ok = train_from_chunks(tokenizer, &chunks, vocab_size, options);
+    }
+    free_chunk_count_table(&chunks);
+    return ok;
+}
+
+// Continues the run a checkpoint was written from, with the pattern, chunk
+// counts and vocab size stored in it. The merges learned match those of an
+// uninterrupted run. Options apply as when training; max_unique_chunks is
+// ignored since the stored chunks were already pruned. Returns false, leaving
+// the tokenizer unchanged, if the checkpoint cannot be read or its chunks are
+// over max_chunk_bytes.
+bool resume_regex_tokenizer_training(RegexTokenizer *tokenizer, const char *checkpoint_file, const TrainOptions *options)
+{
+    TrainOptions resume_options = *options;
+    resume_options.max_unique_chunks = 0;
+    resume_options.extend_merges = false;
+    FILE *f = fopen(checkpoint_file, "rb");
+    if (!f)
+    {
+        perror("Failed to open training checkpoint");
+        return false;
+    }
+    char *data = NULL;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+        data = (char *)counted_malloc(size > 0 ? size : 1);
+        if (data == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for training checkpoint\n");
+            exit(1);
+        }
+        if (fread(data, 1, size, f) != (size_t)size)
+        {
+            size = -1;
+        }
+    }
+    fclose(f);
+    if (size < 0)
+    {
+        perror("Failed to read training checkpoint");
+        free(data);
+        return false;
+    }
+    const char *error = check_train_checkpoint(data, size);
+    if (error)
+    {
+        fprintf(stderr, "Invalid training checkpoint %s: %s\n", checkpoint_file, error);
+        free(data);
+        return false;
+    }
+
+    const TrainCheckpointHeader *header = (const TrainCheckpointHeader *)data;
+    // The stored merges replace the tokenizer's, so they and the merges still
+    // to learn take every id from 256 up to the run's target
+    if (!can_train(tokenizer, (int)header->vocab_size, &resume_options) || !chunk_bytes_fit(header->chunk_bytes_size, &resume_options))
+    {
+        free(data);
+        return false;
+    }
+    char *pattern = counted_strdup(data + header->pattern_offset);
+    if (pattern == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for pattern\n");
+        exit(1);
+    }
+    replace_pattern(tokenizer, pattern);
+    const Pair *merges = (const Pair *)(data + header->merges_offset);
+    tokenizer->merge_size = 0;
+    for (uint32_t i = 0; i < header->merge_size; ++i)
+    {
+        append_merge(tokenizer, merges[i]);
+    }
+    ChunkCountTable chunks;
+    init_chunk_count_table(&chunks, header->chunk_count > 0 ? (int)header->chunk_count : 1);
+    const int32_t *lengths = (const int32_t *)(data + header->chunk_lengths_offset);
+    const int64_t *counts = (const int64_t *)(data + header->chunk_counts_offset);
+    const char *bytes = data + header->chunk_bytes_offset;
+    for (uint32_t i = 0; i < header->chunk_count; ++i)
+    {
+        add_chunk_count(&chunks, bytes, lengths[i], counts[i]);
+        bytes += lengths[i];
+    }
+    int vocab_size = header->vocab_size;
+    free(data);
+
+    // The stored merges are applied to the chunks, which rebuilds the pair
+    // counts they left behind
+    resume_options.extend_merges = true;
+    bool ok = train_from_chunks(tokenizer, &chunks, vocab_size, &resume_options);
+    free_chunk_count_table(&chunks);
+    return ok;
+}
+
+// Looks the piece up in cache, or applies merges and caches the result
+static void encode_piece_with_cache(const RegexTokenizer *tokenizer, EncodeCache *cache, const char *piece, int length,
+                                    BpeScratch *scratch, IntArray *result)
+{
+    if (length <= 0)
+    {
+        return;
+    }
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CHUNKS);
+    int start = result->size;
+    MetricsSample *sample = scratch->metrics;
+    if (sample)
+    {
+        sample->chunks++;
+    }
+    if (!cache || !encode_cache_lookup(cache, piece, length, result))
+    {
+        double merge_start = sample ? monotonic_seconds() : 0.0;
+        encode_chunk(tokenizer, (const unsigned char *)piece, length, scratch, result);
+        if (cache)
+        {
+            encode_cache_insert(cache, piece, length, result->ids + start, result->size - start);
+        }
+        if (sample)
+        {
+            sample->merge_seconds += monotonic_seconds() - merge_start;
+            sample->cache_misses += cache != NULL;
+        }
+    }
+    else if (sample)
+    {
+        sample->cache_hits++;
+    }
+    TRACE(TRACE_LEVEL_CHUNKS, .type = TRACE_CHUNK, .count = result->size - start, .bytes = length,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CHUNKS) - start_time);
+}
+
+static void encode_piece(const RegexTokenizer *tokenizer, const char *piece, int length, BpeScratch *scratch, IntArray *result)
+{
+    encode_piece_with_cache(tokenizer, tokenizer->cache, piece, length, scratch, result);
+}
+
+void init_encode_stream(EncodeStream *stream, const RegexTokenizer *tokenizer, TokenCallback callback, void *user_data)
+{
+    stream->tokenizer = tokenizer;
+    stream->callback = callback;
+    stream->user_data = user_data;
+    stream->max_pending = ENCODE_STREAM_MAX_PENDING;
+    stream->capacity = 4096;
+    stream->size = 0;
+    stream->stopped = false;
+    stream->buffer = (char *)counted_malloc(stream->capacity);
+    if (stream->buffer == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for encode stream\n");
+        exit(1);
+    }
+    init_int_array(&stream->ids, 256);
+    init_bpe_scratch(&stream->scratch, NULL);
+}
+
+void free_encode_stream(EncodeStream *stream)
+{
+    free(stream->buffer);
+    stream->buffer = NULL;
+    stream->size = 0;
+    stream->capacity = 0;
+    free_int_array(&stream->ids);
+    free_bpe_scratch(&stream->scratch);
+}
+
+// Emits every piece whose match can no longer change with more input. With
+// final set, the buffered bytes are the end of the text and all of it is split.
+static void process_encode_stream(EncodeStream *stream, bool final)
+{
+    const RegexTokenizer *tokenizer = stream->tokenizer;
+    size_t usable = final ? stream->size : complete_utf8_prefix(stream->buffer, stream->size);
+    PieceCursor cursor;
+    init_piece_cursor(&cursor, stream->buffer, usable, final ? 0 : PCRE_PARTIAL_HARD);
+    const char *piece;
+    int piece_length;
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, &stream->scratch);
+    while (!stream->stopped && cursor.ptr < cursor.end)
+    {
+        int rc = next_piece(tokenizer, &cursor, &piece, &piece_length);
+        if (rc == PCRE_ERROR_PARTIAL)
+        {
+            break; // The match reaches the end of the buffer; wait for more bytes
+        }
+        if (rc == PCRE_ERROR_NOMATCH)
+        {
+            // No match starts in the rest of the buffer, nor would with more
+            // bytes after it, so those bytes are skipped as in one call
+            cursor.ptr = cursor.end;
+            break;
+        }
+        if (rc < 0)
+        {
+            stream->stopped = true; // Invalid UTF-8 or a PCRE failure
+            break;
+        }
+        encode_piece(tokenizer, piece, piece_length, &stream->scratch, &stream->ids);
+    }
+    size_t pos = stream->stopped ? stream->size : (size_t)(cursor.ptr - stream->buffer);
+    end_encode_sample(&sample, &stream->scratch, pos, stream->ids.size);
+    memmove(stream->buffer, stream->buffer + pos, stream->size - pos);
+    stream->size -= pos;
+
+    if (stream->ids.size > 0)
+    {
+        stream->callback(stream->user_data, stream->ids.ids, stream->ids.size);
+        stream->ids.size = 0;
+    }
+}
+
+void encode_stream_write(EncodeStream *stream, const char *data, size_t length)
+{
+    while (length > 0 && !stream->stopped)
+    {
+        // Feed large writes in slices so the buffer never outgrows the pending limit
+        size_t take = length < stream->max_pending ? length : stream->max_pending;
+        if (stream->size + take > stream->capacity)
+        {
+            while (stream->size + take > stream->capacity)
+            {
+                stream->capacity *= 2;
+            }
+            char *new_buffer = (char *)counted_realloc(stream->buffer, stream->capacity);
+            if (new_buffer == NULL)
+            {
+                fprintf(stderr, "Memory reallocation failed\n");
+                exit(1);
+            }
+            stream->buffer = new_buffer;
+        }
+        memcpy(stream->buffer + stream->size, data, take);
+        stream->size += take;
+        data += take;
+        length -= take;
+
+        process_encode_stream(stream, false);
+        if (stream->size >= stream->max_pending)
+        {
+            // A single piece longer than the limit is cut here rather than buffered without bound
+            size_t keep = stream->size - complete_utf8_prefix(stream->buffer, stream->size);
+            size_t full = stream->size;
+            stream->size -= keep;
+            process_encode_stream(stream, true);
+            memmove(stream->buffer, stream->buffer + full - keep, keep);
+            stream->size = keep;
+        }
+    }
+}
+
+void encode_stream_finish(EncodeStream *stream)
+{
+    process_encode_stream(stream, true);
+    stream->size = 0;
+}
+
+void append_ids_to_int_array(void *user_data, const int *ids, int count)
+{
+    IntArray *array = (IntArray *)user_data;
+    for (int i = 0; i < count; ++i)
+    {
+        append_int_array(array, ids[i]);
+    }
+}
+
+// Splits text and appends the merged ids of every piece to result
+static void encode_ordinary_text(const RegexTokenizer *tokenizer, EncodeCache *cache, const char *text, size_t length,
+                                 BpeScratch *scratch, IntArray *result)
+{
+    PieceCursor cursor;
+    init_piece_cursor(&cursor, text, length, 0);
+    const char *piece;
+    int piece_length;
+    while (next_piece(tokenizer, &cursor, &piece, &piece_length) >= 0)
+    {
+        encode_piece_with_cache(tokenizer, cache, piece, piece_length, scratch, result);
+    }
+}
+
+void init_encode_context(EncodeContext *context)
+{
+    init_arena(&context->arena, 0);
+    init_bpe_scratch(&context->scratch, &context->arena);
+    context->cache = NULL;
+}
+
+// The cache belongs to the context alone, so it takes no locks; this is how
+// threads sharing a FrozenTokenizer cache pieces
+void init_encode_context_with_cache(EncodeContext *context, int cache_capacity)
+{
+    init_encode_context(context);
+    if (cache_capacity > 0)
+    {
+        context->cache = (EncodeCache *)counted_malloc(sizeof(EncodeCache));
+        if (context->cache == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for encode cache\n");
+            exit(1);
+        }
+        init_encode_cache(context->cache, cache_capacity, false);
+    }
+}
+
+void free_encode_context(EncodeContext *context)
+{
+    free_arena(&context->arena);
+    init_bpe_scratch(&context->scratch, &context->arena);
+    if (context->cache)
+    {
+        free_encode_cache(context->cache);
+        free(context->cache);
+        context->cache = NULL;
+    }
+}
+
+static EncodeCache *encode_context_cache(const RegexTokenizer *tokenizer, const EncodeContext *context)
+{
+    return context->cache ? context->cache : tokenizer->cache;
+}
+
+// Drops everything the previous call drew from the arena
+static void begin_encode_context(EncodeContext *context)
+{
+    reset_arena(&context->arena);
+    init_bpe_scratch(&context->scratch, &context->arena);
+}
+
+// Encodes length bytes of text into result, which must be initialized and is
+// overwritten. Unlike encode_regex_tokenizer it stops allocating once context
+// and result have grown to fit the inputs.
+void encode_regex_tokenizer_with_context(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length, IntArray *result)
+{
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    begin_encode_context(context);
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, &context->scratch);
+    result->size = 0;
+    encode_ordinary_text(tokenizer, encode_context_cache(tokenizer, context), text, length, &context->scratch, result);
+    end_encode_sample(&sample, &context->scratch, length, result->size);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_ENCODE, .count = result->size, .bytes = length,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+}
+
+// Smallest id width that holds every id of the vocab, special tokens included
+int token_id_width(const RegexTokenizer *tokenizer)
+{
+    return tokenizer->vocab_size <= 65536 ? TOKEN_ID_WIDTH_16 : TOKEN_ID_WIDTH_32;
+}
+
+static void store_token_ids(void *output, int id_width, const int *ids, size_t count)
+{
+    if (id_width == TOKEN_ID_WIDTH_32)
+    {
+        memcpy(output, ids, count * sizeof(int));
+        return;
+    }
+    uint16_t *narrow = (uint16_t *)output;
+    for (size_t i = 0; i < count; ++i)
+    {
+        narrow[i] = (uint16_t)ids[i];
+    }
+}
+
+// Encodes length bytes of text straight into the caller's buffer of capacity
+// ids of id_width bytes each, one chunk at a time. *count is set to the number
+// of ids the text encodes to; if that exceeds capacity, only the first
+// capacity ids are written. Returns false if the vocab's ids do not fit in
+// id_width bytes.
+bool encode_regex_tokenizer_into(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length, void *output,
+                                 size_t capacity, int id_width, size_t *count)
+{
+    *count = 0;
+    if ((id_width != TOKEN_ID_WIDTH_16 && id_width != TOKEN_ID_WIDTH_32) || id_width < token_id_width(tokenizer))
+    {
+        fprintf(stderr, "Token ids of a %d-token vocab do not fit in %d bytes\n", tokenizer->vocab_size, id_width);
+        return false;
+    }
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    begin_encode_context(context);
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, &context->scratch);
+    EncodeCache *cache = encode_context_cache(tokenizer, context);
+    IntArray piece;
+    init_int_array_in_arena(&piece, &context->arena, 64);
+    PieceCursor cursor;
+    init_piece_cursor(&cursor, text, length, 0);
+    const char *piece_bytes;
+    int piece_length;
+    while (next_piece(tokenizer, &cursor, &piece_bytes, &piece_length) >= 0)
+    {
+        piece.size = 0;
+        encode_piece_with_cache(tokenizer, cache, piece_bytes, piece_length, &context->scratch, &piece);
+        if (*count < capacity)
+        {
+            size_t stored = (size_t)piece.size < capacity - *count ? (size_t)piece.size : capacity - *count;
+            store_token_ids((char *)output + *count * id_width, id_width, piece.ids, stored);
+        }
+        *count += piece.size;
+    }
+    end_encode_sample(&sample, &context->scratch, length, *count);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_ENCODE, .count = (long long)*count, .bytes = length,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+    return true;
+}
+
+// encode_regex_tokenizer_with_context that also sets spans, which must be
+// initialized and is overwritten, to the bytes of text each id came from. The
+// tokens of a piece split its bytes in order, so the spans follow from the
+// piece's offset and the token lengths alone, without copying the text.
+void encode_regex_tokenizer_with_offsets(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length,
+                                         IntArray *result, TokenSpanArray *spans)
+{
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    begin_encode_context(context);
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, &context->scratch);
+    result->size = 0;
+    spans->size = 0;
+    EncodeCache *cache = encode_context_cache(tokenizer, context);
+    const size_t *offsets = tokenizer->vocab_offsets;
+    PieceCursor cursor;
+    init_piece_cursor(&cursor, text, length, 0);
+    const char *piece;
+    int piece_length;
+    while (next_piece(tokenizer, &cursor, &piece, &piece_length) >= 0)
+    {
+        encode_piece_with_cache(tokenizer, cache, piece, piece_length, &context->scratch, result);
+        reserve_token_span_array(spans, result->size);
+        size_t pos = piece - text;
+        for (int i = spans->size; i < result->size; ++i)
+        {
+            int id = result->ids[i];
+            spans->spans[i].start = pos;
+            pos += offsets[id + 1] - offsets[id];
+            spans->spans[i].end = pos;
+        }
+        spans->size = result->size;
+    }
+    end_encode_sample(&sample, &context->scratch, length, result->size);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_ENCODE, .count = result->size, .bytes = length,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+}
+
+// Number of ids encode_regex_tokenizer_with_context would produce for the
+// text. Each piece is encoded into arena scratch and only counted, so nothing
+// grows with the length of the text.
+size_t count_tokens(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length)
+{
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    begin_encode_context(context);
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, &context->scratch);
+    EncodeCache *cache = encode_context_cache(tokenizer, context);
+    IntArray piece;
+    init_int_array_in_arena(&piece, &context->arena, 64);
+    size_t count = 0;
+    PieceCursor cursor;
+    init_piece_cursor(&cursor, text, length, 0);
+    const char *piece_bytes;
+    int piece_length;
+    while (next_piece(tokenizer, &cursor, &piece_bytes, &piece_length) >= 0)
+    {
+        piece.size = 0;
+        encode_piece_with_cache(tokenizer, cache, piece_bytes, piece_length, &context->scratch, &piece);
+        count += piece.size;
+    }
+    end_encode_sample(&sample, &context->scratch, length, count);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_ENCODE, .count = (long long)count, .bytes = length,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+    return count;
+}
+
+// Encodes text into result, which must be initialized and is overwritten,
+// until it holds max_tokens ids; the rest of the text is neither split nor
+// merged. The ids equal the first max_tokens of the full encoding. Returns the
+// byte offset where the text they cover ends, which falls inside a piece when
+// the budget runs out mid-piece.
+size_t encode_regex_tokenizer_prefix(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length,
+                                     size_t max_tokens, IntArray *result)
+{
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    begin_encode_context(context);
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, &context->scratch);
+    result->size = 0;
+    EncodeCache *cache = encode_context_cache(tokenizer, context);
+    size_t consumed = 0;
+    PieceCursor cursor;
+    init_piece_cursor(&cursor, text, length, 0);
+    const char *piece;
+    int piece_length;
+    while ((size_t)result->size < max_tokens && next_piece(tokenizer, &cursor, &piece, &piece_length) >= 0)
+    {
+        int first = result->size;
+        encode_piece_with_cache(tokenizer, cache, piece, piece_length, &context->scratch, result);
+        if ((size_t)result->size > max_tokens)
+        {
+            // Keep the ids that fit; they cover a prefix of the piece
+            result->size = (int)max_tokens;
+            consumed = piece - text;
+            for (int i = first; i < result->size; ++i)
+            {
+                consumed += tokenizer->vocab_offsets[result->ids[i] + 1] - tokenizer->vocab_offsets[result->ids[i]];
+            }
+            break;
+        }
+        consumed = cursor.ptr - text;
+    }
+    end_encode_sample(&sample, &context->scratch, consumed, result->size);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_ENCODE, .count = result->size, .bytes = consumed,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+    return consumed;
+}
+
+void encode_regex_tokenizer(const RegexTokenizer *tokenizer, const char *text, IntArray *result)
+{
+    size_t length = strlen(text);
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    BpeScratch scratch;
+    init_bpe_scratch(&scratch, NULL);
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, &scratch);
+    init_int_array(result, 256);
+    encode_ordinary_text(tokenizer, tokenizer->cache, text, length, &scratch, result);
+    end_encode_sample(&sample, &scratch, length, result->size);
+    free_bpe_scratch(&scratch);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_ENCODE, .count = result->size, .bytes = length,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+}
+
+void init_special_token_policy(SpecialTokenPolicy *policy)
+{
+    // Like tiktoken: every special literal in the text is an error until allowed
+    policy->allowed = SPECIAL_TOKENS_NONE;
+    policy->allowed_ids = NULL;
+    policy->num_allowed_ids = 0;
+    policy->disallowed = SPECIAL_TOKENS_ALL;
+    policy->disallowed_ids = NULL;
+    policy->num_disallowed_ids = 0;
+}
+
+static bool special_token_in_set(SpecialTokenSet set, const int *ids, int num_ids, int id)
+{
+    if (set != SPECIAL_TOKENS_LISTED)
+    {
+        return set == SPECIAL_TOKENS_ALL;
+    }
+    for (int i = 0; i < num_ids; ++i)
+    {
+        if (ids[i] == id)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether policy splits the text at the literal of the special token with this id
+static bool special_token_matters(const SpecialTokenPolicy *policy, int id)
+{
+    return special_token_in_set(policy->allowed, policy->allowed_ids, policy->num_allowed_ids, id) ||
+           special_token_in_set(policy->disallowed, policy->disallowed_ids, policy->num_disallowed_ids, id);
+}
+
+// Finds the leftmost special literal in text[from, length) that policy does
+// not treat as ordinary text, the longest one if several start there. Returns
+// its index in special_tokens and sets *start, or returns -1.
+static int find_special_literal(const RegexTokenizer *tokenizer, const SpecialTokenPolicy *policy, const unsigned char *text,
+                                size_t length, size_t from, size_t *start)
+{
+    const SpecialMatcher *matcher = &tokenizer->special_matcher;
+    int best = -1;
+    size_t best_start = 0;
+    int state = 0;
+    for (size_t i = from; i < length; ++i)
+    {
+        if (state == 0)
+        {
+            if (best >= 0)
+            {
+                break;
+            }
+            // Bytes that start no literal are skipped without touching the automaton
+            while (i < length && matcher->root_next[text[i]] == 0)
+            {
+                i++;
+            }
+            if (i == length)
+            {
+                break;
+            }
+        }
+        state = special_matcher_step(matcher, state, text[i]);
+        // Every later match starts at or after the text this state spells
+        if (best >= 0 && i + 1 - matcher->depth[state] > best_start)
+        {
+            break;
+        }
+        int match = matcher->token[state] >= 0 ? state : matcher->dict_link[state];
+        for (; match >= 0; match = matcher->dict_link[match])
+        {
+            int token = matcher->token[match];
+            if (special_token_matters(policy, tokenizer->special_tokens[token]))
+            {
+                // A match ending later that starts no later is longer
+                size_t match_start = i + 1 - matcher->depth[match];
+                if (best < 0 || match_start <= best_start)
+                {
+                    best = token;
+                    best_start = match_start;
+                }
+                break;
+            }
+        }
+    }
+    *start = best_start;
+    return best;
+}
+
+// Encodes text like encode_regex_tokenizer, except that the literals of
+// allowed special tokens become their ids. Returns false, with result empty,
+// if the text contains a disallowed special token.
+bool encode_regex_tokenizer_special(const RegexTokenizer *tokenizer, const char *text, const SpecialTokenPolicy *policy, IntArray *result)
+{
+    EncodeContext context;
+    init_encode_context(&context);
+    init_int_array(result, 256);
+    bool ok = encode_regex_tokenizer_special_with_context(tokenizer, &context, text, strlen(text), policy, result);
+    free_encode_context(&context);
+    return ok;
+}
+
+// encode_regex_tokenizer_special over length bytes, with the reuse rules of
+// encode_regex_tokenizer_with_context
+bool encode_regex_tokenizer_special_with_context(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length,
+                                                 const SpecialTokenPolicy *policy, IntArray *result)
+{
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    begin_encode_context(context);
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, &context->scratch);
+    result->size = 0;
+    bool scan = tokenizer->special_matcher.num_states > 0 &&
+                (policy->allowed != SPECIAL_TOKENS_NONE || policy->disallowed != SPECIAL_TOKENS_NONE);
+    bool ok = true;
+    size_t pos = 0;
+    while (pos < length)
+    {
+        size_t start = length;
+        int special = scan ? find_special_literal(tokenizer, policy, (const unsigned char *)text, length, pos, &start) : -1;
+        if (special < 0)
+        {
+            start = length;
+        }
+        else if (!special_token_in_set(policy->allowed, policy->allowed_ids, policy->num_allowed_ids, tokenizer->special_tokens[special]))
+        {
+            size_t literal_length = tokenizer->special_offsets[special + 1] - tokenizer->special_offsets[special];
+            fprintf(stderr, "Disallowed special token %.*s at offset %zu\n", (int)literal_length,
+                    tokenizer->special_bytes + tokenizer->special_offsets[special], start);
+            result->size = 0;
+            ok = false;
+            break;
+        }
+        encode_ordinary_text(tokenizer, encode_context_cache(tokenizer, context), text + pos, start - pos, &context->scratch, result);
+        if (special < 0)
+        {
+            break;
+        }
+        append_int_array(result, tokenizer->special_tokens[special]);
+        pos = start + tokenizer->special_offsets[special + 1] - tokenizer->special_offsets[special];
+    }
+    end_encode_sample(&sample, &context->scratch, length, result->size);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_ENCODE, .count = result->size, .bytes = length,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+    return ok;
+}
+
+void init_batch_encoding(BatchEncoding *output)
+{
+    init_batch_encoding_with_width(output, TOKEN_ID_WIDTH_32);
+}
+
+// With TOKEN_ID_WIDTH_16, ids are stored in ids16 at half the memory; only
+// tokenizers whose token_id_width is 2 can encode into it
+void init_batch_encoding_with_width(BatchEncoding *output, int id_width)
 {
-    if (array->size == array->capacity)
-    {
-        array->capacity *= 2;
-        int *new_ids = (int *)realloc(array->ids, array->capacity * sizeof(int));
-        if (new_ids == NULL)
-        {
-            fprintf(stderr, "Memory reallocation failed\n");
-            exit(1);
-        }
-        array->ids = new_ids;
-    }
-    array->ids[array->size++] = value;
+    output->ids = NULL;
+    output->ids16 = NULL;
+    output->offsets = NULL;
+    output->num_texts = 0;
+    output->id_width = id_width == TOKEN_ID_WIDTH_16 ? TOKEN_ID_WIDTH_16 : TOKEN_ID_WIDTH_32;
+    output->ids_capacity = 0;
+    output->offsets_capacity = 0;
 }
 
-void free_int_array(IntArray *array)
+void free_batch_encoding(BatchEncoding *output)
 {
-    if (array->ids)
-        free(array->ids);
-    array->size = 0;
-    array->capacity = 0;
+    int id_width = output->id_width;
+    free(output->ids);
+    free(output->ids16);
+    free(output->offsets);
+    init_batch_encoding_with_width(output, id_width);
 }
 
-void merge(int *ids, int length, Pair pair, int idx, IntArray *result)
+// Next text for worker: the front of its own range, else the back half of
+// the fullest other range. Returns -1 once every range is empty.
+static int next_batch_text(BatchWorker *worker)
 {
-    init_int_array(result, length);
-    printf("Merging pair: (%d, %d) into idx: %d\n", pair.first, pair.second, idx);
+    BatchEncoder *encoder = worker->encoder;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->begin < worker->end)
+    {
+        int text = worker->begin++;
+        pthread_mutex_unlock(&worker->lock);
+        return text;
+    }
+    pthread_mutex_unlock(&worker->lock);
 
-    int i = 0;
-    while (i < length)
+    while (true)
     {
-        if (i < length - 1 && ids[i] == pair.first && ids[i + 1] == pair.second)
+        int victim = -1;
+        int most = 0;
+        for (int i = 1; i < encoder->num_threads; ++i)
         {
-            printf("Found pair at position %d, replacing with %d\n", i, idx);
-            append_int_array(result, idx);
-            i += 2;
+            BatchWorker *candidate = &encoder->workers[(worker->index + i) % encoder->num_threads];
+            pthread_mutex_lock(&candidate->lock);
+            int remaining = candidate->end - candidate->begin;
+            pthread_mutex_unlock(&candidate->lock);
+            if (remaining > most)
+            {
+                most = remaining;
+                victim = candidate->index;
+            }
         }
-        else
+        if (victim < 0)
         {
-            append_int_array(result, ids[i]);
-            i++;
+            return -1;
         }
+        BatchWorker *other = &encoder->workers[victim];
+        pthread_mutex_lock(&other->lock);
+        int remaining = other->end - other->begin;
+        if (remaining <= 0)
+        {
+            pthread_mutex_unlock(&other->lock);
+            continue; // Drained since it was picked
+        }
+        int split = other->end - (remaining + 1) / 2;
+        int end = other->end;
+        other->end = split;
+        pthread_mutex_unlock(&other->lock);
+
+        // The stolen texts become this worker's range, so others can steal from it in turn
+        pthread_mutex_lock(&worker->lock);
+        worker->begin = split + 1;
+        worker->end = end;
+        pthread_mutex_unlock(&worker->lock);
+        return split;
     }
-    printf("Resulting array after merge: ");
-    for (i = 0; i < result->size; ++i)
+}
+
+static void run_batch_worker(BatchWorker *worker)
+{
+    BatchEncoder *encoder = worker->encoder;
+    int text;
+    while ((text = next_batch_text(worker)) >= 0)
     {
-        printf("%d ", result->ids[i]);
+        size_t length = encoder->lengths ? encoder->lengths[text] : strlen(encoder->texts[text]);
+        int start = worker->ids.size;
+        double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+        begin_encode_context(&worker->context);
+        MetricsSample sample;
+        begin_metrics_sample(encoder->tokenizer, &sample, &worker->context.scratch);
+        encode_ordinary_text(encoder->tokenizer, encoder->cache, encoder->texts[text], length, &worker->context.scratch, &worker->ids);
+        end_encode_sample(&sample, &worker->context.scratch, length, worker->ids.size - start);
+        TRACE(TRACE_LEVEL_CALLS, .type = TRACE_ENCODE, .count = worker->ids.size - start, .bytes = length,
+              .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+        // Lengths go one slot ahead so a prefix sum turns them into offsets
+        encoder->text_workers[text] = worker->index;
+        encoder->text_starts[text] = start;
+        encoder->output->offsets[text + 1] = worker->ids.size - start;
     }
-    printf("\n");
 }
 
-void replace_control_characters(const char *input, char *output, int output_size)
+static void *batch_worker_main(void *arg)
 {
-    int j = 0;
-    for (int i = 0; input[i] != '\0' && j < output_size - 1; ++i)
+    BatchWorker *worker = (BatchWorker *)arg;
+    BatchEncoder *encoder = worker->encoder;
+    long long seen = 0;
+    while (true)
     {
-        if (iscntrl((unsigned char)input[i]))
+        pthread_mutex_lock(&encoder->lock);
+        while (encoder->generation == seen && !encoder->shutdown)
         {
-            j += snprintf(output + j, output_size - j, "\\u%04x", (unsigned char)input[i]);
+            pthread_cond_wait(&encoder->start, &encoder->lock);
         }
-        else
+        if (encoder->shutdown)
         {
-            output[j++] = input[i];
+            pthread_mutex_unlock(&encoder->lock);
+            return NULL;
         }
-    }
-    output[j] = '\0';
-}
+        seen = encoder->generation;
+        pthread_mutex_unlock(&encoder->lock);
 
-void render_token(const char *input, char *output, int output_size)
-{
-    char temp[output_size];
-    snprintf(temp, output_size, "%s", input);
-    replace_control_characters(temp, output, output_size);
-}
+        run_batch_worker(worker);
 
-void init_regex_tokenizer(RegexTokenizer *tokenizer, const char *pattern)
-{
-    tokenizer->merges = NULL;
-    tokenizer->merge_size = 0;
-    tokenizer->merge_capacity = 256;
-    tokenizer->merges = (Pair *)malloc(tokenizer->merge_capacity * sizeof(Pair));
-    if (tokenizer->merges == NULL)
-    {
-        fprintf(stderr, "Memory allocation failed for merges\n");
-        exit(1);
-    }
-    tokenizer->pattern = strdup(pattern);
-    if (tokenizer->pattern == NULL)
-    {
-        fprintf(stderr, "Memory allocation failed for pattern\n");
-        exit(1);
+        pthread_mutex_lock(&encoder->lock);
+        if (--encoder->running == 0)
+        {
+            pthread_cond_signal(&encoder->done);
+        }
+        pthread_mutex_unlock(&encoder->lock);
     }
+}
 
-    const char *error;
-    int erroffset;
-    tokenizer->compiled_pattern = pcre_compile(
-        tokenizer->pattern,
-        PCRE_UTF8,
-        &error,
-        &erroffset,
-        NULL);
-    if (tokenizer->compiled_pattern == NULL)
-    {
-        fprintf(stderr, "PCRE compilation failed at offset %d: %s\n", erroffset, error);
-        exit(1);
-    }
+void init_batch_encoder(BatchEncoder *encoder, const RegexTokenizer *tokenizer, int num_threads)
+{
+    encoder->tokenizer = tokenizer;
+    encoder->num_threads = num_threads > 1 ? num_threads : 1;
+    // A cache without locks is only safe while a single thread encodes
+    EncodeCache *cache = tokenizer->cache;
+    encoder->cache = cache && (cache->thread_safe || encoder->num_threads == 1) ? cache : NULL;
+    encoder->generation = 0;
+    encoder->running = 0;
+    encoder->shutdown = false;
+    encoder->texts = NULL;
+    encoder->lengths = NULL;
+    encoder->num_texts = 0;
+    encoder->output = NULL;
+    encoder->text_workers = NULL;
+    encoder->text_starts = NULL;
+    encoder->texts_capacity = 0;
+    pthread_mutex_init(&encoder->lock, NULL);
+    pthread_cond_init(&encoder->start, NULL);
+    pthread_cond_init(&encoder->done, NULL);
 
-    tokenizer->compiled_pattern_extra = pcre_study(tokenizer->compiled_pattern, 0, &error);
-    if (error != NULL)
+    encoder->workers = (BatchWorker *)counted_malloc(encoder->num_threads * sizeof(BatchWorker));
+    encoder->threads = (pthread_t *)counted_malloc(encoder->num_threads * sizeof(pthread_t));
+    if (encoder->workers == NULL || encoder->threads == NULL)
     {
-        fprintf(stderr, "PCRE study failed: %s\n", error);
+        fprintf(stderr, "Memory allocation failed for batch encoder\n");
         exit(1);
     }
-
-    tokenizer->special_tokens = NULL;
-    tokenizer->special_size = 0;
-    tokenizer->special_capacity = 0;
-    tokenizer->vocab = (char **)malloc(256 * sizeof(char *));
-    if (tokenizer->vocab == NULL)
+    for (int t = 0; t < encoder->num_threads; ++t)
     {
-        fprintf(stderr, "Memory allocation failed for vocab\n");
-        exit(1);
+        BatchWorker *worker = &encoder->workers[t];
+        worker->encoder = encoder;
+        worker->index = t;
+        worker->begin = 0;
+        worker->end = 0;
+        pthread_mutex_init(&worker->lock, NULL);
+        init_encode_context(&worker->context);
+        init_int_array(&worker->ids, 256);
     }
-    for (int i = 0; i < 256; ++i)
+    for (int t = 1; t < encoder->num_threads; ++t)
     {
-        tokenizer->vocab[i] = (char *)malloc(2);
-        if (tokenizer->vocab[i] == NULL)
+        if (pthread_create(&encoder->threads[t], NULL, batch_worker_main, &encoder->workers[t]) != 0)
         {
-            fprintf(stderr, "Memory allocation failed for vocab[%d]\n", i);
+            fprintf(stderr, "Failed to create batch encoder thread\n");
             exit(1);
         }
-        tokenizer->vocab[i][0] = (char)i;
-        tokenizer->vocab[i][1] = '\0';
     }
 }
 
-void free_regex_tokenizer(RegexTokenizer *tokenizer)
+void free_batch_encoder(BatchEncoder *encoder)
 {
-    free(tokenizer->pattern);
-    free(tokenizer->special_tokens);
-    for (int i = 0; i < 256; ++i)
-    {
-        free(tokenizer->vocab[i]);
-    }
-    free(tokenizer->vocab);
-    if (tokenizer->merges)
-    {
-        free(tokenizer->merges);
-    }
-    if (tokenizer->compiled_pattern)
+    pthread_mutex_lock(&encoder->lock);
+    encoder->shutdown = true;
+    pthread_cond_broadcast(&encoder->start);
+    pthread_mutex_unlock(&encoder->lock);
+    for (int t = 1; t < encoder->num_threads; ++t)
     {
-        pcre_free(tokenizer->compiled_pattern);
+        pthread_join(encoder->threads[t], NULL);
     }
-    if (tokenizer->compiled_pattern_extra)
+    for (int t = 0; t < encoder->num_threads; ++t)
     {
-        pcre_free_study(tokenizer->compiled_pattern_extra);
+        pthread_mutex_destroy(&encoder->workers[t].lock);
+        free_encode_context(&encoder->workers[t].context);
+        free_int_array(&encoder->workers[t].ids);
     }
+    free(encoder->workers);
+    free(encoder->threads);
+    free(encoder->text_workers);
+    free(encoder->text_starts);
+    pthread_mutex_destroy(&encoder->lock);
+    pthread_cond_destroy(&encoder->start);
+    pthread_cond_destroy(&encoder->done);
 }
 
-void build_vocab(RegexTokenizer *tokenizer)
+// Encodes texts[0..num_texts) into output. lengths may be NULL for
+// NUL-terminated texts.
+// Returns false, encoding nothing, if the tokenizer's ids do not fit the
+// output's id width
+bool encode_batch(BatchEncoder *encoder, const char *const *texts, const size_t *lengths, int num_texts, BatchEncoding *output)
 {
-    for (int i = 0; i < 256; ++i)
+    if (output->id_width < token_id_width(encoder->tokenizer))
     {
-        tokenizer->vocab[i] = (char *)malloc(2);
-        if (tokenizer->vocab[i] == NULL)
-        {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
-        tokenizer->vocab[i][0] = (char)i;
-        tokenizer->vocab[i][1] = '\0';
+        fprintf(stderr, "Token ids of a %d-token vocab do not fit in %d bytes\n", encoder->tokenizer->vocab_size, output->id_width);
+        return false;
     }
-    for (int i = 0; i < tokenizer->merge_size; ++i)
+    if (num_texts > encoder->texts_capacity)
     {
-        Pair pair = tokenizer->merges[i];
-        int idx = 256 + i;
-        char *merged = (char *)malloc(strlen(tokenizer->vocab[pair.first]) + strlen(tokenizer->vocab[pair.second]) + 1);
-        if (merged == NULL)
+        int capacity = encoder->texts_capacity > 0 ? encoder->texts_capacity : 64;
+        while (capacity < num_texts)
+        {
+            capacity *= 2;
+        }
+        int *text_workers = (int *)counted_realloc(encoder->text_workers, capacity * sizeof(int));
+        int *text_starts = text_workers ? (int *)counted_realloc(encoder->text_starts, capacity * sizeof(int)) : NULL;
+        if (text_workers == NULL || text_starts == NULL)
         {
-            fprintf(stderr, "Memory allocation failed\n");
+            fprintf(stderr, "Memory reallocation failed\n");
             exit(1);
         }
-        strcpy(merged, tokenizer->vocab[pair.first]);
-        strcat(merged, tokenizer->vocab[pair.second]);
-        tokenizer->vocab[idx] = merged;
+        encoder->text_workers = text_workers;
+        encoder->text_starts = text_starts;
+        encoder->texts_capacity = capacity;
     }
-    for (int i = 0; i < tokenizer->special_size; ++i)
+    if (num_texts + 1 > output->offsets_capacity)
     {
-        int idx = tokenizer->special_tokens[i];
-        char *special = (char *)malloc(2);
-        if (special == NULL)
+        int capacity = output->offsets_capacity > 0 ? output->offsets_capacity : 64;
+        while (capacity < num_texts + 1)
+        {
+            capacity *= 2;
+        }
+        size_t *offsets = (size_t *)counted_realloc(output->offsets, capacity * sizeof(size_t));
+        if (offsets == NULL)
         {
-            fprintf(stderr, "Memory allocation failed\n");
+            fprintf(stderr, "Memory reallocation failed\n");
             exit(1);
         }
-        special[0] = (char)idx;
-        special[1] = '\0';
-        tokenizer->vocab[idx] = special;
+        output->offsets = offsets;
+        output->offsets_capacity = capacity;
     }
-}
+    output->num_texts = num_texts;
+    output->offsets[0] = 0;
 
-void save_tokenizer(RegexTokenizer *tokenizer, const char *file_prefix)
-{
-    char model_file[256];
-    snprintf(model_file, sizeof(model_file), "%s.model", file_prefix);
-    FILE *f = fopen(model_file, "w");
-    if (!f)
-    {
-        perror("Failed to open model file");
-        return;
-    }
-    fprintf(f, "minbpe v1\n");
-    fprintf(f, "%s\n", tokenizer->pattern);
-    fprintf(f, "%d\n", tokenizer->special_size);
-    for (int i = 0; i < tokenizer->special_size; ++i)
-    {
-        fprintf(f, "%d\n", tokenizer->special_tokens[i]);
-    }
-    for (int i = 0; i < tokenizer->merge_size; ++i)
+    // Every worker starts with an equal share of the texts
+    encoder->texts = texts;
+    encoder->lengths = lengths;
+    encoder->num_texts = num_texts;
+    encoder->output = output;
+    for (int t = 0; t < encoder->num_threads; ++t)
     {
-        fprintf(f, "%d %d\n", tokenizer->merges[i].first, tokenizer->merges[i].second);
+        BatchWorker *worker = &encoder->workers[t];
+        worker->begin = (int)((long long)num_texts * t / encoder->num_threads);
+        worker->end = (int)((long long)num_texts * (t + 1) / encoder->num_threads);
+        worker->ids.size = 0;
     }
-    fclose(f);
-}
 
-void load_tokenizer(RegexTokenizer *tokenizer, const char *model_file)
-{
-    FILE *f = fopen(model_file, "r");
-    if (!f)
-    {
-        perror("Failed to open model file");
-        return;
-    }
-    char version[16];
-    fscanf(f, "%15s", version);
-    if (strcmp(version, "minbpe v1") != 0)
-    {
-        fprintf(stderr, "Unsupported version: %s\n", version);
-        fclose(f);
-        return;
-    }
-    size_t pattern_size = 256;
-    tokenizer->pattern = (char *)malloc(pattern_size);
-    if (tokenizer->pattern == NULL)
-    {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
-    getline(&tokenizer->pattern, &pattern_size, f);
-    int num_special;
-    fscanf(f, "%d", &num_special);
-    tokenizer->special_tokens = (int *)malloc(num_special * sizeof(int));
-    if (tokenizer->special_tokens == NULL)
+    if (encoder->num_threads > 1)
     {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+        pthread_mutex_lock(&encoder->lock);
+        encoder->running = encoder->num_threads - 1;
+        encoder->generation++;
+        pthread_cond_broadcast(&encoder->start);
+        pthread_mutex_unlock(&encoder->lock);
     }
-    tokenizer->special_size = num_special;
-    for (int i = 0; i < num_special; ++i)
+    run_batch_worker(&encoder->workers[0]);
+    pthread_mutex_lock(&encoder->lock);
+    while (encoder->running > 0)
     {
-        fscanf(f, "%d", &tokenizer->special_tokens[i]);
+        pthread_cond_wait(&encoder->done, &encoder->lock);
     }
-    tokenizer->merge_capacity = 256;
-    tokenizer->merges = (Pair *)malloc(tokenizer->merge_capacity * sizeof(Pair));
-    if (tokenizer->merges == NULL)
+    pthread_mutex_unlock(&encoder->lock);
+
+    for (int i = 0; i < num_texts; ++i)
     {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
+        output->offsets[i + 1] += output->offsets[i];
     }
-    tokenizer->merge_size = 0;
-    int idx = 256;
-    while (fscanf(f, "%d %d", &tokenizer->merges[tokenizer->merge_size].first, &tokenizer->merges[tokenizer->merge_size].second) == 2)
+    size_t total = output->offsets[num_texts];
+    if (total > output->ids_capacity)
     {
-        tokenizer->merge_size++;
-        if (tokenizer->merge_size == tokenizer->merge_capacity)
+        size_t capacity = output->ids_capacity > 0 ? output->ids_capacity : 1024;
+        while (capacity < total)
         {
-            tokenizer->merge_capacity *= 2;
-            Pair *new_merges = (Pair *)realloc(tokenizer->merges, tokenizer->merge_capacity * sizeof(Pair));
-            if (new_merges == NULL)
-            {
-                fprintf(stderr, "Memory reallocation failed\n");
-                exit(1);
-            }
-            tokenizer->merges = new_merges;
+            capacity *= 2;
+        }
+        void **buffer = output->id_width == TOKEN_ID_WIDTH_16 ? (void **)&output->ids16 : (void **)&output->ids;
+        void *ids = counted_realloc(*buffer, capacity * output->id_width);
+        if (ids == NULL)
+        {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
         }
-        idx++;
+        *buffer = ids;
+        output->ids_capacity = capacity;
     }
-    fclose(f);
-    build_vocab(tokenizer);
-}
-
-void train_regex_tokenizer(RegexTokenizer *tokenizer, const char *text, int vocab_size)
-{
-    if (vocab_size < 256)
+    char *base = output->id_width == TOKEN_ID_WIDTH_16 ? (char *)output->ids16 : (char *)output->ids;
+    for (int i = 0; i < num_texts; ++i)
     {
-        fprintf(stderr, "Vocab size must be at least 256\n");
-        return;
+        const IntArray *ids = &encoder->workers[encoder->text_workers[i]].ids;
+        store_token_ids(base + output->offsets[i] * output->id_width, output->id_width, ids->ids + encoder->text_starts[i],
+                        output->offsets[i + 1] - output->offsets[i]);
     }
-    int num_merges = vocab_size - 256;
+    encoder->texts = NULL;
+    encoder->lengths = NULL;
+    encoder->output = NULL;
+    return true;
+}
 
-    // Split the text into text chunks using the regex pattern
-    int rc;
-    int ovector[30];
-    const char *ptr = text;
-    IntArray ids;
-    init_int_array(&ids, 256);
-    while ((rc = pcre_exec(tokenizer->compiled_pattern, tokenizer->compiled_pattern_extra, ptr, strlen(ptr), 0, 0, ovector, 30)) >= 0)
+// Exact number of bytes decode_regex_tokenizer writes for ids, without the terminator
+size_t decoded_size_regex_tokenizer(const RegexTokenizer *tokenizer, const IntArray *ids)
+{
+    size_t size = 0;
+    for (int i = 0; i < ids->size; ++i)
     {
-        for (int i = ovector[0]; i < ovector[1]; ++i)
+        int idx = ids->ids[i];
+        if (idx >= 0 && idx < tokenizer->vocab_size)
         {
-            append_int_array(&ids, (int)(unsigned char)ptr[i]);
+            size += tokenizer->vocab_offsets[idx + 1] - tokenizer->vocab_offsets[idx];
         }
-        ptr += ovector[1];
     }
+    return size;
+}
 
-    // Initialize merge structures
-    PairCountTable stats;
-    init_pair_count_table(&stats, 256);
-
-    // Iteratively merge the most common pairs to create new tokens
-    for (int i = 0; i < num_merges; ++i)
+int decode_regex_tokenizer(const RegexTokenizer *tokenizer, const IntArray *ids, char *output, int output_size)
+{
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, NULL);
+    size_t pos = 0;
+    size_t limit = output_size > 0 ? (size_t)output_size - 1 : 0;
+    const size_t *offsets = tokenizer->vocab_offsets;
+    for (int i = 0; i < ids->size; ++i)
     {
-        // Count the number of times every consecutive pair appears
-        get_stats(ids.ids, ids.size, &stats);
-
-        // Find the pair with the highest count
-        int max_count = -1;
-        Pair max_pair = {0, 0};
-        for (int j = 0; j < stats.size; ++j)
+        int idx = ids->ids[i];
+        if (idx < 0 || idx >= tokenizer->vocab_size)
         {
-            if (stats.counts[j] > max_count)
-            {
-                max_count = stats.counts[j];
-                max_pair = stats.pairs[j];
-            }
+            fprintf(stderr, "Invalid token id: %d\n", idx);
+            continue;
         }
-
-        // Mint a new token: assign it the next available id
-        int idx = 256 + i;
-
-        // Replace all occurrences of pair in ids with idx
-        IntArray new_ids;
-        merge(ids.ids, ids.size, max_pair, idx, &new_ids);
-
-        // Save the merge
-        if (tokenizer->merge_size == tokenizer->merge_capacity)
+        size_t length = offsets[idx + 1] - offsets[idx];
+        if (length > limit - pos)
         {
-            tokenizer->merge_capacity *= 2;
-            Pair *new_merges = (Pair *)realloc(tokenizer->merges, tokenizer->merge_capacity * sizeof(Pair));
-            if (new_merges == NULL)
-            {
-                fprintf(stderr, "Memory reallocation failed\n");
-                exit(1);
-            }
-            tokenizer->merges = new_merges;
+            length = limit - pos; // Truncate to the caller's buffer
         }
-        tokenizer->merges[tokenizer->merge_size++] = max_pair;
-
-        // Free old ids and use the new ids
-        free_int_array(&ids);
-        ids = new_ids;
-
-        // Reset stats for the next iteration
-        free_pair_count_table(&stats);
-        init_pair_count_table(&stats, 256);
+        memcpy(output + pos, tokenizer->vocab_bytes + offsets[idx], length);
+        pos += length;
     }
-
-    // Clean up
-    free_int_array(&ids);
-    free_pair_count_table(&stats);
+    if (output_size > 0)
+    {
+        output[pos] = '\0'; // Null-terminate the output string
+    }
+    end_decode_sample(&sample, ids->size, pos);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_DECODE, .count = ids->size, .bytes = pos,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+    return (int)pos;
 }
 
-void encode_regex_tokenizer(RegexTokenizer *tokenizer, const char *text, IntArray *result)
+static const char utf8_replacement[] = "\xEF\xBF\xBD"; // U+FFFD
+
+// Bytes the UTF-8 character starting at bytes[0] needs in *need, and how many
+// of the length available are a valid start of it: *need when it is whole,
+// 0 when bytes[0] cannot start a character. Accepts what is_valid_utf8 does.
+static int utf8_valid_prefix(const unsigned char *bytes, size_t length, int *need)
 {
-    int rc;
-    int ovector[30];
-    const char *ptr = text;
-    init_int_array(result, 256);
-    while ((rc = pcre_exec(tokenizer->compiled_pattern, tokenizer->compiled_pattern_extra, ptr, strlen(ptr), 0, 0, ovector, 30)) >= 0)
+    unsigned char c = bytes[0];
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    if (c < 0x80)
     {
-        for (int i = ovector[0]; i < ovector[1]; ++i)
-        {
-            append_int_array(result, (int)(unsigned char)ptr[i]);
-            printf("Encoding character: %c (%d)\n", ptr[i], (int)(unsigned char)ptr[i]);
-        }
-        ptr += ovector[1];
+        *need = 1;
+        return 1;
     }
-
-    IntArray encoded;
-    init_int_array(&encoded, result->size);
-
-    while (result->size >= 2)
+    if (c >= 0xC2 && c <= 0xDF)
     {
-        PairCountTable stats;
-        init_pair_count_table(&stats, 256);
-        get_stats(result->ids, result->size, &stats);
-        int min_index = -1;
-        Pair min_pair = {0, 0};
-        for (int i = 0; i < stats.size; ++i)
-        {
-            if (stats.pairs[i].first >= tokenizer->merge_size || stats.pairs[i].second >= tokenizer->merge_size)
-            {
-                continue; // Skip invalid pairs
-            }
-            if (min_index == -1 || tokenizer->merges[stats.pairs[i].first].first < tokenizer->merges[min_pair.first].first)
-            {
-                min_pair = stats.pairs[i];
-                min_index = i;
-            }
-        }
-        if (min_index == -1)
-        {
-            break;
-        }
-        int idx = tokenizer->merges[min_pair.first].first;
-        IntArray temp_encoded;
-        init_int_array(&temp_encoded, result->size);
-        merge(result->ids, result->size, min_pair, idx, &temp_encoded);
-        free_int_array(result);
-        *result = temp_encoded;
-        free_pair_count_table(&stats);
+        *need = 2;
     }
-
-    for (int i = 0; i < result->size; ++i)
+    else if (c >= 0xE0 && c <= 0xEF)
     {
-        append_int_array(&encoded, result->ids[i]);
+        *need = 3;
+        low = c == 0xE0 ? 0xA0 : 0x80; // overlong
+        high = c == 0xED ? 0x9F : 0xBF; // surrogates
     }
-
-    free_int_array(result);
-    *result = encoded;
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+        *need = 4;
+        low = c == 0xF0 ? 0x90 : 0x80; // overlong
+        high = c == 0xF4 ? 0x8F : 0xBF; // above U+10FFFF
+    }
+    else
+    {
+        *need = 1;
+        return 0;
+    }
+    int valid = 1;
+    while (valid < *need && (size_t)valid < length && bytes[valid] >= low && bytes[valid] <= high)
+    {
+        valid++;
+        low = 0x80;
+        high = 0xBF;
+    }
+    return valid;
 }
 
-void add_decoded_token(int idx, int *decoded_tokens, int *decoded_size)
+void init_decode_stream(DecodeStream *stream, const RegexTokenizer *tokenizer, TextCallback callback, void *user_data)
 {
-    decoded_tokens[*decoded_size] = idx;
-    (*decoded_size)++;
+    stream->tokenizer = tokenizer;
+    stream->callback = callback;
+    stream->user_data = user_data;
+    stream->pending_size = 0;
 }
 
-int is_already_decoded(int idx, int *decoded_tokens, int decoded_size)
+// Passes on the whole characters of one token's bytes, holding back an
+// incomplete one at the end. Returns how many bytes were emitted.
+static size_t decode_stream_bytes(DecodeStream *stream, const unsigned char *bytes, size_t length)
 {
-    for (int i = 0; i < decoded_size; ++i)
+    size_t emitted = 0;
+    size_t i = 0;
+    int need;
+    // First finish the character held back from earlier tokens
+    while (stream->pending_size > 0 && i < length)
     {
-        if (decoded_tokens[i] == idx)
+        stream->pending[stream->pending_size++] = bytes[i++];
+        int valid = utf8_valid_prefix(stream->pending, stream->pending_size, &need);
+        if (valid == need)
         {
-            return 1;
+            stream->callback(stream->user_data, (const char *)stream->pending, need);
+            emitted += need;
+            stream->pending_size = 0;
         }
-    }
-    return 0;
-}
-
-void decode_merge_token(RegexTokenizer *tokenizer, int idx, char *output, int *pos, int output_size, int *decoded_tokens, int *decoded_size)
-{
-    if (idx < 256)
-    {
-        // Single character token
-        if (*pos < output_size - 1)
+        else if (valid < stream->pending_size)
         {
-            output[(*pos)++] = (char)idx;
-            printf("Decoded single char: %c at pos: %d\n", (char)idx, *pos - 1);
+            // The new byte does not continue it; it is looked at again below
+            stream->callback(stream->user_data, utf8_replacement, 3);
+            emitted += 3;
+            stream->pending_size = 0;
+            i--;
         }
     }
-    else if (idx >= 256 && idx < 256 + tokenizer->merge_size)
+    size_t run = i;
+    while (i < length)
     {
-        // Merge token
-        int merge_idx = idx - 256;
-        if (!is_already_decoded(idx, decoded_tokens, *decoded_size))
+        if (bytes[i] < 0x80)
+        {
+            i++;
+            continue;
+        }
+        int valid = utf8_valid_prefix(bytes + i, length - i, &need);
+        if (valid == need)
+        {
+            i += need;
+            continue;
+        }
+        if (i > run)
         {
-            add_decoded_token(idx, decoded_tokens, decoded_size);
-            decode_merge_token(tokenizer, tokenizer->merges[merge_idx].first, output, pos, output_size, decoded_tokens, decoded_size);
-            decode_merge_token(tokenizer, tokenizer->merges[merge_idx].second, output, pos, output_size, decoded_tokens, decoded_size);
+            stream->callback(stream->user_data, (const char *)bytes + run, i - run);
+            emitted += i - run;
         }
+        if (valid > 0 && i + valid == length)
+        {
+            // Could still be completed by the next token
+            memcpy(stream->pending, bytes + i, valid);
+            stream->pending_size = valid;
+            return emitted;
+        }
+        stream->callback(stream->user_data, utf8_replacement, 3);
+        emitted += 3;
+        i += valid > 0 ? valid : 1;
+        run = i;
     }
-    else
+    if (i > run)
     {
-        fprintf(stderr, "Invalid token id: %d\n", idx);
+        stream->callback(stream->user_data, (const char *)bytes + run, i - run);
+        emitted += i - run;
     }
+    return emitted;
 }
 
-void decode_regex_tokenizer(RegexTokenizer *tokenizer, IntArray *ids, char *output, int output_size)
+// Decodes count ids, passing on their text as soon as it is whole. Invalid
+// ids are reported and skipped, as by decode_regex_tokenizer.
+void decode_stream_write(DecodeStream *stream, const int *ids, int count)
 {
-    int pos = 0;
-    int decoded_tokens[1024];
-    int decoded_size = 0;
-
-    printf("Decoding sequence: ");
-    for (int i = 0; i < ids->size; ++i)
+    double start_time = TRACE_CLOCK(TRACE_LEVEL_CALLS);
+    const RegexTokenizer *tokenizer = stream->tokenizer;
+    MetricsSample sample;
+    begin_metrics_sample(tokenizer, &sample, NULL);
+    const size_t *offsets = tokenizer->vocab_offsets;
+    size_t emitted = 0;
+    for (int i = 0; i < count; ++i)
     {
-        printf("%d ", ids->ids[i]);
+        int idx = ids[i];
+        if (idx < 0 || idx >= tokenizer->vocab_size)
+        {
+            fprintf(stderr, "Invalid token id: %d\n", idx);
+            continue;
+        }
+        const unsigned char *bytes = (const unsigned char *)tokenizer->vocab_bytes + offsets[idx];
+        emitted += decode_stream_bytes(stream, bytes, offsets[idx + 1] - offsets[idx]);
     }
-    printf("\n");
+    end_decode_sample(&sample, count, emitted);
+    TRACE(TRACE_LEVEL_CALLS, .type = TRACE_DECODE, .count = count, .bytes = emitted,
+          .seconds = TRACE_CLOCK(TRACE_LEVEL_CALLS) - start_time);
+}
 
-    for (int i = 0; i < ids->size; ++i)
+// Ends the stream: a character still incomplete comes out as U+FFFD. The
+// stream can then be reused for a new sequence.
+void decode_stream_finish(DecodeStream *stream)
+{
+    if (stream->pending_size > 0)
     {
-        int idx = ids->ids[i];
-        printf("Decoding token id: %d\n", idx);
-        decode_merge_token(tokenizer, idx, output, &pos, output_size, decoded_tokens, &decoded_size);
+        stream->callback(stream->user_data, utf8_replacement, 3);
+        stream->pending_size = 0;
     }
-    output[pos] = '\0'; // Null-terminate the output string
-    printf("Final decoded output: %s\n", output);
 }
@@ -2,6 +2,9 @@
 #define TOKENIZER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <pcre.h>
 
 typedef struct
@@ -10,57 +13,519 @@ typedef struct
     int second;
 } Pair;
 
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+// Bump allocator. Memory is released only all at once, by reset_arena, which
+// also folds the blocks into one; a warmed-up arena therefore serves each
+// cycle from a single block without calling malloc.
+typedef struct
+{
+    ArenaBlock *head; // block being bumped; full blocks follow
+    size_t total;     // bytes in all blocks
+} Arena;
+
+// Pair counts in insertion order, indexed by an open-addressing hash table
+// of positions into pairs/counts. Iterating pairs[0..size) visits pairs in the
+// order they were first seen, which keeps tie-breaking stable.
 typedef struct
 {
     Pair *pairs;
     int *counts;
     int size;
     int capacity;
+    int *slots;
+    int slot_mask;
+    Arena *arena; // where the arrays live, or NULL for the heap
 } PairCountTable;
 
+typedef struct
+{
+    size_t offset;
+    int length;
+    uint32_t hash;
+} Chunk;
+
+// Unique pre-tokenized chunks with their frequencies, in order of first
+// appearance. Chunk bytes are stored back to back in one buffer.
+typedef struct
+{
+    char *bytes;
+    size_t bytes_size;
+    size_t bytes_capacity;
+    Chunk *chunks;
+    long long *counts;
+    int size;
+    int capacity;
+    int *slots;
+    int slot_mask;
+} ChunkCountTable;
+
 typedef struct
 {
     int *ids;
     int size;
     int capacity;
+    Arena *arena; // where ids lives, or NULL for the heap
 } IntArray;
 
+// Bytes [start, end) of the text that one token was encoded from
+typedef struct
+{
+    size_t start;
+    size_t end;
+} TokenSpan;
+
+// Spans parallel to the ids of an encoding: spans[i] belongs to ids[i]
+typedef struct
+{
+    TokenSpan *spans;
+    int size;
+    int capacity;
+} TokenSpanArray;
+
+// Scratch space for applying merges inside one chunk, grown to the longest
+// chunk seen and reused across chunks
+typedef struct
+{
+    int *ids;
+    int *prev;
+    int *next;
+    uint64_t *heap;
+    int heap_size;
+    int capacity;
+    Arena *arena;                 // where the arrays live, or NULL for the heap
+    struct MetricsSample *metrics; // counters of the call in progress while metrics are on
+} BpeScratch;
+
+#define ENCODE_CACHE_MAX_PIECE 32 // longer pieces bypass the cache
+#define ENCODE_CACHE_SHARDS 16     // lock stripes of a thread-safe cache
+
+typedef struct
+{
+    uint32_t hash;
+    int key_length;
+    int num_ids;
+    int prev; // LRU list, most recently used first
+    int next;
+    char key[ENCODE_CACHE_MAX_PIECE];
+    int ids[ENCODE_CACHE_MAX_PIECE];
+} EncodeCacheEntry;
+
+typedef struct
+{
+    EncodeCacheEntry *entries;
+    int *slots;
+    int slot_mask;
+    int size;
+    int capacity;
+    int head;
+    int tail;
+    long long hits;
+    long long misses;
+    pthread_mutex_t lock;
+} EncodeCacheShard;
+
+// Bounded LRU map from the bytes of a regex piece to the ids it encodes to.
+// Entries are preallocated, so a warm cache never allocates.
+typedef struct
+{
+    EncodeCacheShard *shards;
+    int num_shards;
+    bool thread_safe;
+} EncodeCache;
+
+// Reusable state for encoding on one thread. Scratch memory comes from the
+// arena, which is reset at the start of every call, so once it has grown to
+// fit the largest input seen, encoding through a context allocates nothing.
+// A context may carry its own unsynchronized cache, used instead of the
+// tokenizer's; such a context must keep encoding with the same tokenizer.
+typedef struct
+{
+    Arena arena;
+    BpeScratch scratch;
+    EncodeCache *cache; // NULL to use the tokenizer's cache
+} EncodeContext;
+
+// Aho-Corasick automaton over the literals of the special tokens. Out of
+// the root, transitions are a full table; every other state keeps its edges
+// sorted by byte in edge_bytes/edge_targets[edge_begin[s], edge_begin[s + 1]).
+typedef struct
+{
+    int *root_next; // 256 entries, 0 where no literal starts with the byte
+    int *edge_begin;
+    unsigned char *edge_bytes;
+    int *edge_targets;
+    int *fail;
+    int *depth;
+    int *token;     // special token whose literal ends in the state, or -1
+    int *dict_link; // nearest state on the fail chain with a token, or -1
+    int num_states;
+} SpecialMatcher;
+
+#define METRICS_LATENCY_BUCKETS 20 // bucket i counts calls under 2^i microseconds
+
+// What a tokenizer has done since its metrics were last reset. Counters only
+// grow while metrics are on; times are in nanoseconds. The last latency
+// bucket counts calls slower than all the others.
+typedef struct
+{
+    uint64_t encode_calls;
+    uint64_t encode_bytes;  // bytes in
+    uint64_t encode_tokens; // ids out
+    uint64_t chunks;        // pieces split off by the pattern
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t encode_ns;
+    uint64_t merge_ns; // applying merges to pieces not found in a cache; the rest of encode_ns is splitting
+    uint64_t decode_calls;
+    uint64_t decode_tokens;
+    uint64_t decode_bytes;
+    uint64_t decode_ns;
+    uint64_t process_allocations; // heap allocations by the library in the whole process, not this tokenizer
+    uint64_t encode_latency[METRICS_LATENCY_BUCKETS + 1];
+    uint64_t decode_latency[METRICS_LATENCY_BUCKETS + 1];
+} TokenizerMetrics;
+
+// Live counters of one tokenizer, updated with relaxed atomics so that any
+// number of threads can record and read them at once
+typedef struct
+{
+    int enabled;
+    TokenizerMetrics counters;
+} MetricsRecorder;
+
+typedef enum
+{
+    METRICS_FORMAT_JSON,
+    METRICS_FORMAT_PROMETHEUS
+} MetricsFormat;
+
+// Split pattern of GPT-2. Tokenizers built with exactly this pattern split
+// text with a hand-written scanner instead of PCRE, unless its Unicode tables
+// disagree with those of the linked PCRE.
+#define GPT2_SPLIT_PATTERN "'(?:[sdmt]|ll|ve|re)| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+"
+
+typedef enum
+{
+    SPLIT_SCANNER_PCRE,
+    SPLIT_SCANNER_GPT2
+} SplitScanner;
+
 typedef struct
 {
     Pair *merges;
     int merge_size;
     int merge_capacity;
+    int *merge_slots; // open-addressing (first, second) -> rank index over merges
+    int merge_slot_mask;
+    EncodeCache *cache; // NULL when encode caching is disabled
     char *pattern;
     pcre *compiled_pattern;
     pcre_extra *compiled_pattern_extra;
-    int *special_tokens;
+    SplitScanner split_scanner;
+    int *special_tokens;     // ids of the special tokens
+    char *special_bytes;     // their literals, back to back
+    size_t *special_offsets; // special_size + 1 offsets into special_bytes
     int special_size;
     int special_capacity;
-    char **vocab;
+    SpecialMatcher special_matcher;
+    char *vocab_bytes;     // bytes of every token id, back to back
+    size_t *vocab_offsets; // vocab_size + 1 offsets into vocab_bytes
+    int vocab_size;
+    void *mapping; // read-only binary model the arrays above point into, or NULL
+    size_t mapping_size;
+    MetricsRecorder *metrics; // off until set_tokenizer_metrics turns it on
 } RegexTokenizer;
 
+// A trained or loaded tokenizer made read-only for serving. Encoding and
+// decoding only read .tokenizer, which has no shared cache, so any number of
+// threads may use one FrozenTokenizer at once without locks, each through its
+// own EncodeContext.
+typedef struct
+{
+    RegexTokenizer tokenizer;
+} FrozenTokenizer;
+
+typedef struct
+{
+    int merges_done;          // including merges restored from a checkpoint
+    int merges_total;         // vocab_size - 256
+    long long best_count;     // weighted count of the pair merged last
+    double merges_per_second; // since this run started or resumed
+    double elapsed_seconds;
+    double eta_seconds;
+} TrainProgress;
+
+// Returning false stops training after the current merge
+typedef bool (*TrainProgressCallback)(void *user_data, const TrainProgress *progress);
+
+#define TRAIN_MAX_CHUNK_BYTES ((size_t)INT32_MAX) // training indexes chunk bytes with ints
+
+typedef struct
+{
+    int num_threads;                // workers for pre-tokenization and large merges; 1 trains serially
+    int max_unique_chunks;          // 0 keeps every chunk; otherwise only the most frequent are trained on
+    size_t max_chunk_bytes;         // unique chunk bytes over this fail training; at most TRAIN_MAX_CHUNK_BYTES
+    bool extend_merges;             // keep the tokenizer's merges and learn more after them
+    TrainProgressCallback progress; // NULL reports nothing
+    void *progress_user_data;
+    double progress_interval;       // seconds between progress reports
+    const char *checkpoint_path;    // NULL writes no checkpoints
+    double checkpoint_interval;     // seconds between checkpoints
+} TrainOptions;
+
+typedef enum
+{
+    SPECIAL_TOKENS_NONE,
+    SPECIAL_TOKENS_ALL,
+    SPECIAL_TOKENS_LISTED // the ids in the accompanying list
+} SpecialTokenSet;
+
+// How encode_regex_tokenizer_special treats special token literals in the
+// text. Allowed literals become their token id, disallowed ones make encoding
+// fail, and the rest are encoded as ordinary text. A token that is both
+// allowed and disallowed is allowed, so disallowed = SPECIAL_TOKENS_ALL means
+// every token that is not allowed.
+typedef struct
+{
+    SpecialTokenSet allowed;
+    const int *allowed_ids;
+    int num_allowed_ids;
+    SpecialTokenSet disallowed;
+    const int *disallowed_ids;
+    int num_disallowed_ids;
+} SpecialTokenPolicy;
+
+typedef void (*TokenCallback)(void *user_data, const int *ids, int count);
+typedef void (*TextCallback)(void *user_data, const char *text, size_t length);
+
+// Tracing is compiled in up to this level: 0 strips it entirely, 1 reports one
+// event per training merge and per encode or decode call, 2 also reports every
+// chunk and every pair replaced by merge()
+#define TRACE_LEVEL_NONE 0
+#define TRACE_LEVEL_CALLS 1
+#define TRACE_LEVEL_CHUNKS 2
+#ifndef TOKENIZER_TRACE_LEVEL
+#define TOKENIZER_TRACE_LEVEL TRACE_LEVEL_NONE
+#endif
+
+typedef enum
+{
+    TRACE_TRAIN_MERGE, // pair, seen count times, became token id
+    TRACE_ENCODE,      // bytes of input became count ids
+    TRACE_DECODE,      // count ids became bytes of output
+    TRACE_CHUNK,       // one split chunk of bytes became count ids
+    TRACE_MERGE        // merge() replaced pair at position with token id
+} TraceEventType;
+
+typedef struct
+{
+    TraceEventType type;
+    Pair pair;
+    int id;
+    int position;
+    long long count;
+    size_t bytes;
+    double seconds; // time spent, for encode, decode and chunk events
+} TraceEvent;
+
+// Called from whichever thread produced the event
+typedef void (*TraceCallback)(void *user_data, const TraceEvent *event);
+
+#define ENCODE_STREAM_MAX_PENDING (1 << 20)
+
+// Incremental encoder over a sequence of byte buffers. Bytes are held back
+// while the regex match they belong to could still grow, and a trailing
+// partial UTF-8 sequence waits for its continuation bytes, so for valid UTF-8
+// the output is the same as encoding the concatenated input in one call. A
+// single piece longer than max_pending bytes is cut at that point to keep
+// memory bounded, and invalid UTF-8 stops the stream where it occurs.
+typedef struct
+{
+    const RegexTokenizer *tokenizer;
+    TokenCallback callback;
+    void *user_data;
+    char *buffer;
+    size_t size;
+    size_t capacity;
+    size_t max_pending;
+    bool stopped;
+    IntArray ids;
+    BpeScratch scratch;
+} EncodeStream;
+
+// Incremental decoder over a sequence of token ids. Only whole UTF-8
+// characters are passed on: bytes of a character split across tokens are
+// held back until the token completing it arrives, and bytes that cannot
+// form a character come out as U+FFFD. Text is handed to the callback
+// straight from the vocab, so decoding never allocates.
+typedef struct
+{
+    const RegexTokenizer *tokenizer;
+    TextCallback callback;
+    void *user_data;
+    unsigned char pending[4]; // start of an incomplete character
+    int pending_size;
+} DecodeStream;
+
+// Bytes per token id in compact output: 2 while every id is below 65536
+#define TOKEN_ID_WIDTH_16 2
+#define TOKEN_ID_WIDTH_32 4
+
+// Ids of a batch of texts in one buffer; text i encodes to
+// ids[offsets[i], offsets[i + 1]), in ids16 instead when id_width is
+// TOKEN_ID_WIDTH_16. Buffers only grow, so reusing one BatchEncoding across
+// batches stops allocating once it is large enough.
+typedef struct
+{
+    int *ids;
+    uint16_t *ids16;
+    size_t *offsets;
+    int num_texts;
+    int id_width;
+    size_t ids_capacity;
+    int offsets_capacity;
+} BatchEncoding;
+
+// One thread of a BatchEncoder. It takes texts from the front of its range
+// [begin, end) and, once that is empty, steals the back half of another
+// worker's range.
+typedef struct
+{
+    struct BatchEncoder *encoder;
+    int index;
+    int begin;
+    int end;
+    pthread_mutex_t lock; // guards begin and end
+    EncodeContext context;
+    IntArray ids; // ids of the texts this worker encoded in the current batch
+} BatchWorker;
+
+// Work-stealing pool that encodes batches of texts with one shared tokenizer.
+// The calling thread works as worker 0. Scratch space and per-worker output
+// are kept between batches. One batch runs at a time per encoder.
+typedef struct BatchEncoder
+{
+    const RegexTokenizer *tokenizer;
+    EncodeCache *cache; // the tokenizer's cache when workers may share it, else NULL
+    int num_threads;
+    pthread_t *threads;
+    BatchWorker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    long long generation; // bumped for every batch
+    int running;          // pool threads still working on the current batch
+    bool shutdown;
+    const char *const *texts;
+    const size_t *lengths;
+    int num_texts;
+    BatchEncoding *output;
+    int *text_workers; // worker that encoded each text
+    int *text_starts;  // where its ids start in that worker's ids
+    int texts_capacity;
+} BatchEncoder;
+
+bool set_trace_callback(TraceCallback callback, void *user_data);
+
+void init_arena(Arena *arena, size_t initial_size);
+void *arena_alloc(Arena *arena, size_t size);
+void reset_arena(Arena *arena);
+void free_arena(Arena *arena);
+
 void init_pair_count_table(PairCountTable *table, int initial_capacity);
+void init_pair_count_table_in_arena(PairCountTable *table, Arena *arena, int initial_capacity);
 void free_pair_count_table(PairCountTable *table);
 void add_or_update_pair_count(PairCountTable *table, Pair pair);
 void get_stats(int *ids, int length, PairCountTable *table);
 void print_pair_counts(PairCountTable *table);
 
+void init_chunk_count_table(ChunkCountTable *table, int initial_capacity);
+void free_chunk_count_table(ChunkCountTable *table);
+void add_chunk_count(ChunkCountTable *table, const char *bytes, int length, long long count);
+
 void init_int_array(IntArray *array, int initial_capacity);
+void init_int_array_in_arena(IntArray *array, Arena *arena, int initial_capacity);
 void append_int_array(IntArray *array, int value);
 void free_int_array(IntArray *array);
 
+void init_token_span_array(TokenSpanArray *array, int initial_capacity);
+void free_token_span_array(TokenSpanArray *array);
+
 void merge(int *ids, int length, Pair pair, int idx, IntArray *result);
+int merge_in_place(int *ids, int length, Pair pair, int idx);
+
+void init_encode_cache(EncodeCache *cache, int capacity, bool thread_safe);
+void free_encode_cache(EncodeCache *cache);
+void clear_encode_cache(EncodeCache *cache);
+bool encode_cache_lookup(EncodeCache *cache, const char *piece, int length, IntArray *result);
+void encode_cache_insert(EncodeCache *cache, const char *piece, int length, const int *ids, int num_ids);
+void encode_cache_stats(EncodeCache *cache, long long *hits, long long *misses);
 
 void replace_control_characters(const char *input, char *output, int output_size);
 void render_token(const char *input, char *output, int output_size);
 
 void init_regex_tokenizer(RegexTokenizer *tokenizer, const char *pattern);
+void init_regex_tokenizer_with_cache(RegexTokenizer *tokenizer, const char *pattern, int cache_capacity, bool thread_safe_cache);
 void free_regex_tokenizer(RegexTokenizer *tokenizer);
+void init_train_options(TrainOptions *options);
 void train_regex_tokenizer(RegexTokenizer *tokenizer, const char *text, int vocab_size);
-void encode_regex_tokenizer(RegexTokenizer *tokenizer, const char *text, IntArray *result);
-void decode_regex_tokenizer(RegexTokenizer *tokenizer, IntArray *ids, char *output, int output_size);
+void train_regex_tokenizer_with_options(RegexTokenizer *tokenizer, const char *text, int vocab_size, const TrainOptions *options);
+bool train_regex_tokenizer_from_files(RegexTokenizer *tokenizer, const char *const *paths, int num_paths, int vocab_size,
+                                      const TrainOptions *options);
+bool resume_regex_tokenizer_training(RegexTokenizer *tokenizer, const char *checkpoint_file, const TrainOptions *options);
+void encode_regex_tokenizer(const RegexTokenizer *tokenizer, const char *text, IntArray *result);
+bool register_special_tokens(RegexTokenizer *tokenizer, const char *const *literals, const int *ids, int count);
+void init_special_token_policy(SpecialTokenPolicy *policy);
+bool encode_regex_tokenizer_special(const RegexTokenizer *tokenizer, const char *text, const SpecialTokenPolicy *policy, IntArray *result);
+void init_encode_context(EncodeContext *context);
+void init_encode_context_with_cache(EncodeContext *context, int cache_capacity);
+void free_encode_context(EncodeContext *context);
+void encode_regex_tokenizer_with_context(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length, IntArray *result);
+bool encode_regex_tokenizer_special_with_context(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length,
+                                                 const SpecialTokenPolicy *policy, IntArray *result);
+int token_id_width(const RegexTokenizer *tokenizer);
+bool encode_regex_tokenizer_into(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length, void *output,
+                                 size_t capacity, int id_width, size_t *count);
+void encode_regex_tokenizer_with_offsets(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length,
+                                         IntArray *result, TokenSpanArray *spans);
+size_t count_tokens(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length);
+size_t encode_regex_tokenizer_prefix(const RegexTokenizer *tokenizer, EncodeContext *context, const char *text, size_t length,
+                                     size_t max_tokens, IntArray *result);
+void init_encode_stream(EncodeStream *stream, const RegexTokenizer *tokenizer, TokenCallback callback, void *user_data);
+void encode_stream_write(EncodeStream *stream, const char *data, size_t length);
+void encode_stream_finish(EncodeStream *stream);
+void free_encode_stream(EncodeStream *stream);
+void append_ids_to_int_array(void *user_data, const int *ids, int count);
+void init_batch_encoding(BatchEncoding *output);
+void init_batch_encoding_with_width(BatchEncoding *output, int id_width);
+void free_batch_encoding(BatchEncoding *output);
+void init_batch_encoder(BatchEncoder *encoder, const RegexTokenizer *tokenizer, int num_threads);
+void free_batch_encoder(BatchEncoder *encoder);
+bool encode_batch(BatchEncoder *encoder, const char *const *texts, const size_t *lengths, int num_texts, BatchEncoding *output);
+int decode_regex_tokenizer(const RegexTokenizer *tokenizer, const IntArray *ids, char *output, int output_size);
+size_t decoded_size_regex_tokenizer(const RegexTokenizer *tokenizer, const IntArray *ids);
+void init_decode_stream(DecodeStream *stream, const RegexTokenizer *tokenizer, TextCallback callback, void *user_data);
+void decode_stream_write(DecodeStream *stream, const int *ids, int count);
+void decode_stream_finish(DecodeStream *stream);
 void build_vocab(RegexTokenizer *tokenizer);
+void build_merge_ranks(RegexTokenizer *tokenizer);
+int find_merge_rank(const RegexTokenizer *tokenizer, Pair pair);
 void save_tokenizer(RegexTokenizer *tokenizer, const char *file_prefix);
-void load_tokenizer(RegexTokenizer *tokenizer, const char *model_file);
+bool load_tokenizer(RegexTokenizer *tokenizer, const char *model_file);
+bool save_tokenizer_binary(const RegexTokenizer *tokenizer, const char *model_file);
+bool init_regex_tokenizer_from_binary(RegexTokenizer *tokenizer, const char *model_file, int cache_capacity, bool thread_safe_cache);
+void set_tokenizer_metrics(const RegexTokenizer *tokenizer, bool enabled);
+void read_tokenizer_metrics(const RegexTokenizer *tokenizer, TokenizerMetrics *metrics);
+void reset_tokenizer_metrics(const RegexTokenizer *tokenizer);
+size_t format_tokenizer_metrics(const TokenizerMetrics *metrics, MetricsFormat format, const char *name, char *output, size_t size);
+void freeze_regex_tokenizer(FrozenTokenizer *frozen, RegexTokenizer *tokenizer);
+const RegexTokenizer *frozen_tokenizer(const FrozenTokenizer *frozen);
+void free_frozen_tokenizer(FrozenTokenizer *frozen);
 
 #endif // TOKENIZER_H
@@ -0,0 +1,18 @@
+#ifndef UNICODE_TABLES_H
+#define UNICODE_TABLES_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t first;
+    uint32_t last;
+} UnicodeRange;
+
+// Sorted, non-overlapping code point ranges of the general categories L and N
+extern const UnicodeRange unicode_letter_ranges[];
+extern const int unicode_letter_ranges_size;
+extern const UnicodeRange unicode_number_ranges[];
+extern const int unicode_number_ranges_size;
+
+#endif // UNICODE_TABLES_H